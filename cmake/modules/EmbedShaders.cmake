@@ -0,0 +1,66 @@
+# Embed compiled SPIR-V in a generated header as one bundle, indexed by
+# shader name and content hash, so the program never reads or compiles
+# shaders at run time.  Run in script mode:
+#
+#   cmake -DOUTPUT=shader_bundle.h -DSHADERS=a.rgen.spv|b.rmiss.spv -P EmbedShaders.cmake
+#
+# Shaders are named by their file name without ".spv" and the index is
+# sorted by name.
+
+string(REPLACE "|" ";" SHADER_LIST "${SHADERS}")
+list(SORT SHADER_LIST)
+
+set(WORDS "")
+set(ENTRIES "")
+set(OFFSET 0)
+
+# CMake regular expressions have no {n} repetition
+set(EIGHT_WORDS "")
+foreach(I RANGE 1 8)
+    string(APPEND EIGHT_WORDS "0x........,")
+endforeach()
+
+foreach(SPIRV ${SHADER_LIST})
+    get_filename_component(NAME ${SPIRV} NAME)
+    string(REGEX REPLACE "\\.spv$" "" NAME ${NAME})
+
+    file(READ ${SPIRV} HEX HEX)
+    string(LENGTH "${HEX}" HEX_LENGTH)
+    math(EXPR WORD_COUNT "${HEX_LENGTH} / 8")
+
+    string(SHA1 HASH "${HEX}")
+    string(SUBSTRING ${HASH} 0 16 HASH)
+
+    # SPIR-V is a stream of little-endian 32-bit words
+    string(REGEX REPLACE "(..)(..)(..)(..)" "0x\\4\\3\\2\\1," HEX_WORDS "${HEX}")
+    string(REGEX REPLACE "(${EIGHT_WORDS})" "\\1\n    " HEX_WORDS "${HEX_WORDS}")
+
+    string(APPEND WORDS "    // ${NAME}\n    ${HEX_WORDS}\n")
+    string(APPEND ENTRIES "    {\"${NAME}\", 0x${HASH}ULL, ${OFFSET}, ${WORD_COUNT}},\n")
+    math(EXPR OFFSET "${OFFSET} + ${WORD_COUNT}")
+endforeach()
+
+list(LENGTH SHADER_LIST SHADER_COUNT)
+
+file(WRITE ${OUTPUT}
+"// Generated by cmake/modules/EmbedShaders.cmake; do not edit
+
+#include <cstdint>
+#include <cstddef>
+
+struct shader_bundle_entry
+{
+    const char* name;
+    uint64_t hash;          // of the SPIR-V words
+    uint32_t offset;        // into shader_bundle_words
+    uint32_t word_count;
+};
+
+static const uint32_t shader_bundle_words[] = {
+${WORDS}};
+
+static const shader_bundle_entry shader_bundle_entries[] = {
+${ENTRIES}};
+
+static const size_t shader_bundle_entry_count = ${SHADER_COUNT};
+")
@@ -1,702 +1,5681 @@
-#include <iostream>
-#include <algorithm>
-#include <memory>
-#include <vector>
-#include <map>
-#include <set>
-#include <string>
-
-#include <cstring>
-#include <cassert>
-
-#include <vulkan/vulkan.h>
-#include <GLFW/glfw3.h>
-
-#if defined(_WIN32)
-#define PLATFORM_WINDOWS
-// Windows supported
-#elif defined(__linux__)
-#define PLATFORM_LINUX
-// Linux supported
-#elif defined(__APPLE__) && defined(__MACH__)
-// MacOS not supported yet but want to get to runtime
-#define PLATFORM_MOLTENVK
-#else
-#error Platform not supported.
-#endif
-
-#define DEFAULT_FENCE_TIMEOUT 100000000000
-
-VkInstance instance;
-VkPhysicalDevice physical_device;
-const uint32_t NO_QUEUE_FAMILY = 0xffffffff;
-uint32_t preferred_queue_family = NO_QUEUE_FAMILY;
-VkDevice device;
-VkPhysicalDeviceMemoryProperties memory_properties;
-VkQueue queue;
-VkCommandPool command_pool;
-VkSurfaceKHR surface;
-
-#ifdef PLATFORM_MACOS
-void *window;
-#endif // PLATFORM_MACOS
-
-bool be_noisy = true;
-bool enable_validation = false;
-bool dump_vulkan_calls = false;
-
-struct Vertex
-{
-    float v[3];
-    float c[3];
-};
-
-// geometry data
-Vertex vertices[3] = {
-    {{0, 0, 0}, {1, 0, 0}},
-    {{1, 0, 0}, {0, 1, 0}},
-    {{0, 1, 0}, {0, 0, 1}},
-};
-uint32_t indices[3] = {0, 1, 2}; 
-
-struct buffer {
-    VkDeviceMemory mem;
-    VkBuffer buf;
-};
-
-buffer vertex_buffer;
-buffer index_buffer;
-
-#if 0
-
-VkDeviceMemory vs_uniform_block_memory;
-VkBuffer vs_uniform_block_buffer;
-VkDescriptorBufferInfo vs_uniform_block_descriptor;
-
-struct {
-    float projection[16];
-    float model[16];
-    float view[16];
-};
-
-VkPipelineLayout pipeline_layout;
-VkPipeline pipeline;
-VkDescriptorSetLayout descriptor_set_layout;
-VkDescriptorSet descriptor_set;
-
-VkSemaphore present_complete;
-VkSemaphore render_complete;
-std::Vector<VkFence> wait_fences;
-
-#endif
-
-#define STR(f) #f
-
-std::map<VkResult, std::string> vkresult_name_map =
-{
-    {VK_ERROR_OUT_OF_HOST_MEMORY, "OUT_OF_HOST_MEMORY"},
-    {VK_ERROR_OUT_OF_DEVICE_MEMORY, "OUT_OF_DEVICE_MEMORY"},
-    {VK_ERROR_INITIALIZATION_FAILED, "INITIALIZATION_FAILED"},
-    {VK_ERROR_DEVICE_LOST, "DEVICE_LOST"},
-    {VK_ERROR_MEMORY_MAP_FAILED, "MEMORY_MAP_FAILED"},
-    {VK_ERROR_LAYER_NOT_PRESENT, "LAYER_NOT_PRESENT"},
-    {VK_ERROR_EXTENSION_NOT_PRESENT, "EXTENSION_NOT_PRESENT"},
-    {VK_ERROR_FEATURE_NOT_PRESENT, "FEATURE_NOT_PRESENT"},
-};
-
-#define VK_CHECK(f) \
-{ \
-    VkResult result = (f); \
-    if(result != VK_SUCCESS) { \
-	if(vkresult_name_map.count(f) > 0) { \
-	    std::cerr << "VkResult from " STR(f) " was " << vkresult_name_map[result] << " at line " << __LINE__ << "\n"; \
-	} \
-	else \
-	    std::cerr << "VkResult from " STR(f) " was " << result << " at line " << __LINE__ << "\n"; \
-	exit(EXIT_FAILURE); \
-    } \
-}
-
-
-void print_implementation_information()
-{
-    uint32_t ext_count;
-    vkEnumerateInstanceExtensionProperties(nullptr, &ext_count, nullptr);
-    std::unique_ptr<VkExtensionProperties[]> exts(new VkExtensionProperties[ext_count]);
-    vkEnumerateInstanceExtensionProperties(nullptr, &ext_count, exts.get());
-    if(be_noisy) {
-        printf("Vulkan instance extensions:\n");
-        for(int i = 0; i < ext_count; i++)
-            printf("    (%08X) %s\n", exts[i].specVersion, exts[i].extensionName);
-    }
-}
-
-void create_instance(VkInstance* instance)
-{
-    std::set<std::string> extension_set;
-    std::set<std::string> layer_set;
-
-    uint32_t glfw_reqd_extension_count;
-    const char** glfw_reqd_extensions = glfwGetRequiredInstanceExtensions(&glfw_reqd_extension_count);
-    for(int i = 0; i < glfw_reqd_extension_count; i++) {
-	extension_set.insert(glfw_reqd_extensions[i]);
-    }
-
-    extension_set.insert(VK_KHR_SURFACE_EXTENSION_NAME);
-#if defined(PLATFORM_WINDOWS)
-    extension_set.insert("VK_KHR_win32_surface");
-#elif defined(PLATFORM_LINUX)
-    extension_set.insert("VK_KHR_xcb_surface");
-#elif defined(PLATFORM_MACOS)
-    extension_set.insert("VK_MVK_macos_surface");
-#endif
-
-    if(enable_validation) {
-	layer_set.insert("VK_LAYER_KHRONOS_validation");
-    }
-    if(dump_vulkan_calls) {
-	layer_set.insert("VK_LAYER_LUNARG_api_dump");
-    }
-
-    {
-        std::vector<const char*> extensions;
-        std::vector<const char*> layers;
-	// Careful - only valid for duration of sets where contents have not changed
-	for(auto& s: extension_set)
-	    extensions.push_back(s.c_str());
-
-	for(auto& s: layer_set)
-	    layers.push_back(s.c_str());
-
-	VkApplicationInfo app_info = {};
-	app_info.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
-	app_info.pApplicationName = "triangle";
-	app_info.pEngineName = "triangle";
-	app_info.apiVersion = VK_API_VERSION_1_2;
-
-	VkInstanceCreateInfo create = {};
-	create.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
-	create.pNext = NULL;
-	create.pApplicationInfo = &app_info;
-	create.enabledExtensionCount = extensions.size();
-	create.ppEnabledExtensionNames = extensions.data();
-	create.enabledLayerCount = layers.size();
-	create.ppEnabledLayerNames = layers.data();
-
-	VK_CHECK(vkCreateInstance(&create, nullptr, instance));
-    }
-}
-
-void choose_physical_device(VkInstance instance, VkPhysicalDevice* physical_device)
-{
-    uint32_t gpu_count = 0;
-    VK_CHECK(vkEnumeratePhysicalDevices(instance, &gpu_count, nullptr));
-    if(be_noisy) {
-        std::cerr << gpu_count << " gpus enumerated\n";
-    }
-    VkPhysicalDevice physical_devices[32];
-    gpu_count = std::min(32u, gpu_count);
-    VK_CHECK(vkEnumeratePhysicalDevices(instance, &gpu_count, physical_devices));
-    *physical_device = physical_devices[0];
-}
-
-const char* device_types[] = {
-    "other",
-    "integrated GPU",
-    "discrete GPU",
-    "virtual GPU",
-    "CPU",
-    "unknown",
-};
-
-std::map<uint32_t, std::string> memory_property_bit_name_map = {
-    {VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, "DEVICE_LOCAL"},
-    {VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, "HOST_VISIBLE"},
-    {VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, "HOST_COHERENT"},
-    {VK_MEMORY_PROPERTY_HOST_CACHED_BIT, "HOST_CACHED"},
-    {VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT, "LAZILY_ALLOCATED"},
-};
-
-void print_memory_property_bits(VkMemoryPropertyFlags flags)
-{
-    bool add_or = false;
-    for(auto& bit : memory_property_bit_name_map)
-	if(flags & bit.first) {
-	    printf("%s%s", add_or ? " | " : "", bit.second.c_str());
-	    add_or = true;
-	}
-}
-
-void print_device_information(VkPhysicalDevice physical_device)
-{
-    VkPhysicalDeviceProperties properties;
-    vkGetPhysicalDeviceProperties(physical_device, &properties);
-
-    printf("Physical Device Information\n");
-    printf("    API     %d.%d.%d\n", properties.apiVersion >> 22, (properties.apiVersion >> 12) & 0x3ff, properties.apiVersion & 0xfff);
-    printf("    driver  %X\n", properties.driverVersion);
-    printf("    vendor  %X\n", properties.vendorID);
-    printf("    device  %X\n", properties.deviceID);
-    printf("    name    %s\n", properties.deviceName);
-    printf("    type    %s\n", device_types[std::min(5, (int)properties.deviceType)]);
-
-    uint32_t ext_count;
-
-    vkEnumerateDeviceExtensionProperties(physical_device, nullptr, &ext_count, nullptr);
-    std::unique_ptr<VkExtensionProperties[]> exts(new VkExtensionProperties[ext_count]);
-    vkEnumerateDeviceExtensionProperties(physical_device, nullptr, &ext_count, exts.get());
-    printf("    extensions:\n");
-    for(int i = 0; i < ext_count; i++)
-	printf("        %s\n", exts[i].extensionName);
-
-    // VkPhysicalDeviceLimits              limits;
-    // VkPhysicalDeviceSparseProperties    sparseProperties;
-    //
-    uint32_t queue_family_count;
-    vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &queue_family_count, nullptr);
-    std::unique_ptr<VkQueueFamilyProperties[]> queue_families(new VkQueueFamilyProperties[queue_family_count]);
-    vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &queue_family_count, queue_families.get());
-    if(be_noisy) {
-        for(int i = 0; i < queue_family_count; i++) {
-            printf("queue %d:\n", i);
-            printf("    flags:                       %04X\n", queue_families[i].queueFlags);
-            printf("    queueCount:                  %d\n", queue_families[i].queueCount);
-            printf("    timestampValidBits:          %d\n", queue_families[i].timestampValidBits);
-            printf("    minImageTransferGranularity: (%d, %d, %d)\n",
-                queue_families[i].minImageTransferGranularity.width,
-                queue_families[i].minImageTransferGranularity.height,
-                queue_families[i].minImageTransferGranularity.depth);
-        }
-    }
-
-    for(int i = 0; i < memory_properties.memoryTypeCount; i++) {
-        printf("memory type %d: flags ", i);
-        print_memory_property_bits(memory_properties.memoryTypes[i].propertyFlags);
-        printf("\n");
-    }
-}
-
-void create_device(VkPhysicalDevice physical_device, VkDevice* device)
-{
-    std::vector<const char*> extensions;
-
-    extensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
-    extensions.insert(extensions.end(), {
-        VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME,
-        VK_KHR_RAY_TRACING_PIPELINE_EXTENSION_NAME,
-        VK_KHR_RAY_QUERY_EXTENSION_NAME
-    });
-
-
-    VkDeviceQueueCreateInfo create_queues[1] = {};
-    float queue_priorities[1] = {1.0f};
-    create_queues[0].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-    create_queues[0].pNext = NULL;
-    create_queues[0].flags = 0;
-    create_queues[0].queueFamilyIndex = preferred_queue_family;
-    create_queues[0].queueCount = 1;
-    create_queues[0].pQueuePriorities = queue_priorities;
-
-    VkDeviceCreateInfo create = {};
-
-    create.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
-    create.pNext = NULL;
-    create.flags = 0;
-    create.queueCreateInfoCount = 1;
-    create.pQueueCreateInfos = create_queues;
-    create.enabledExtensionCount = extensions.size();
-    create.ppEnabledExtensionNames = extensions.data();
-    VK_CHECK(vkCreateDevice(physical_device, &create, nullptr, device));
-
-    vkGetDeviceQueue(*device, preferred_queue_family, 0, &queue);
-
-    VkCommandPoolCreateInfo create_command_pool = {};
-    create_command_pool.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-    create_command_pool.flags = 0;
-    create_command_pool.queueFamilyIndex = preferred_queue_family;
-    VK_CHECK(vkCreateCommandPool(*device, &create_command_pool, nullptr, &command_pool));
-}
-
-// Sascha Willem's 
-uint32_t getMemoryTypeIndex(uint32_t type_bits, VkMemoryPropertyFlags properties)
-{
-    // Iterate over all memory types available for the device used in this example
-    for (uint32_t i = 0; i < memory_properties.memoryTypeCount; i++)
-	if (type_bits & (1 << i))
-	    if ((memory_properties.memoryTypes[i].propertyFlags & properties) == properties)
-		return i;
-
-    throw "Could not find a suitable memory type!";
-}
-
-// Sascha Willem's 
-VkCommandBuffer getCommandBuffer(bool begin)
-{
-    VkCommandBuffer cmdBuffer;
-
-    VkCommandBufferAllocateInfo cmdBufAllocateInfo = {};
-    cmdBufAllocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    cmdBufAllocateInfo.commandPool = command_pool;
-    cmdBufAllocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    cmdBufAllocateInfo.commandBufferCount = 1;
-
-    VK_CHECK(vkAllocateCommandBuffers(device, &cmdBufAllocateInfo, &cmdBuffer));
-
-    // If requested, also start the new command buffer
-    if (begin) {
-	VkCommandBufferBeginInfo cmdBufInfo = {};
-	cmdBufInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-	cmdBufInfo.flags = 0;
-	VK_CHECK(vkBeginCommandBuffer(cmdBuffer, &cmdBufInfo));
-    }
-
-    return cmdBuffer;
-}
-
-// Sascha Willem's 
-void flushCommandBuffer(VkCommandBuffer commandBuffer)
-{
-    assert(commandBuffer != VK_NULL_HANDLE);
-
-    VK_CHECK(vkEndCommandBuffer(commandBuffer));
-
-    VkSubmitInfo submitInfo = {};
-    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &commandBuffer;
-
-    // Create fence to ensure that the command buffer has finished executing
-    VkFenceCreateInfo fenceCreateInfo = {};
-    fenceCreateInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-    fenceCreateInfo.flags = 0;
-    VkFence fence;
-    VK_CHECK(vkCreateFence(device, &fenceCreateInfo, nullptr, &fence));
-
-    // Submit to the queue
-    VK_CHECK(vkQueueSubmit(queue, 1, &submitInfo, fence));
-    // Wait for the fence to signal that command buffer has finished executing
-    VK_CHECK(vkWaitForFences(device, 1, &fence, VK_TRUE, DEFAULT_FENCE_TIMEOUT));
-
-    vkDestroyFence(device, fence, nullptr);
-    vkFreeCommandBuffers(device, command_pool, 1, &commandBuffer);
-}
-
-void create_vertex_buffers(const Vertex* vertices, size_t verticesSize, const uint32_t *indices, size_t indicesSize)
-{
-    // host-writable memory and buffers
-    buffer vertex_staging;
-    buffer index_staging;
-    void *mapped; // when mapped, this points to the buffer
-
-    // Tells us how much memory and which memory types (by bit) can hold this memory
-    VkMemoryRequirements memory_req = {};
-
-    // Allocate memory
-    VkMemoryAllocateInfo memory_alloc = {};
-    memory_alloc.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    memory_alloc.pNext = nullptr;
-
-    // Create a buffer - buffers are used for things like vertex data
-    // This one will be used as the source of a transfer to a GPU-addressable
-    // buffer
-    VkBufferCreateInfo create_staging_buffer = {};
-    create_staging_buffer.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    create_staging_buffer.pNext = nullptr;
-    create_staging_buffer.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
-
-
-    // Create a buffer for vertices, allocate memory, map it, copy vertices to the memory, unmap, and then bind the vertex buffer to that memory.
-    create_staging_buffer.size = sizeof(vertices);
-    VK_CHECK(vkCreateBuffer(device, &create_staging_buffer, nullptr, &vertex_staging.buf));
-
-    // Get the size and type requirements for memory containing this buffer
-    vkGetBufferMemoryRequirements(device, vertex_staging.buf, &memory_req);
-
-    memory_alloc.allocationSize = memory_req.size;
-    // Find the type which this memory requires which is visible to the
-    // CPU and also coherent, so when we unmap it it will be immediately
-    // visible to the GPU
-    memory_alloc.memoryTypeIndex = getMemoryTypeIndex(memory_req.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-    VK_CHECK(vkAllocateMemory(device, &memory_alloc, nullptr, &vertex_staging.mem));
-
-    // Map the memory, fill it, and unmap it
-    VK_CHECK(vkMapMemory(device, vertex_staging.mem, 0, memory_alloc.allocationSize, 0, &mapped));
-    memcpy(mapped, vertices, sizeof(vertices));
-    vkUnmapMemory(device, vertex_staging.mem);
-
-    // Tell Vulkan our buffer is in this memory at offset 0
-    VK_CHECK(vkBindBufferMemory(device, vertex_staging.buf, vertex_staging.mem, 0));
-
-
-    // Create a buffer for indices, allocate memory, map it, copy indices to the memory, unmap, and then bind the index buffer to that memory.
-    create_staging_buffer.size = sizeof(indices);
-    VK_CHECK(vkCreateBuffer(device, &create_staging_buffer, nullptr, &index_staging.buf));
-
-    // Get the size and type requirements for memory containing this buffer
-    vkGetBufferMemoryRequirements(device, index_staging.buf, &memory_req);
-
-    memory_alloc.allocationSize = memory_req.size;
-    // Find the type which this memory requires which is visible to the
-    // CPU and also coherent, so when we unmap it it will be immediately
-    // visible to the GPU
-    memory_alloc.memoryTypeIndex = getMemoryTypeIndex(memory_req.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-    VK_CHECK(vkAllocateMemory(device, &memory_alloc, nullptr, &index_staging.mem));
-
-    // Map the memory, fill it, and unmap it
-    VK_CHECK(vkMapMemory(device, index_staging.mem, 0, memory_alloc.allocationSize, 0, &mapped));
-    memcpy(mapped, indices, sizeof(indices));
-    vkUnmapMemory(device, index_staging.mem);
-
-    // Tell Vulkan our buffer is in this memory at offset 0
-    VK_CHECK(vkBindBufferMemory(device, index_staging.buf, index_staging.mem, 0));
-
-
-    // This buffer will be used as the source of a transfer to a
-    // GPU-addressable buffer
-    VkBufferCreateInfo create_vertex_buffer = {};
-    create_vertex_buffer.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    create_vertex_buffer.pNext = nullptr;
-    create_vertex_buffer.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
-
-    // Create a buffer representing vertices on the GPU
-    create_vertex_buffer.size = sizeof(vertices);
-    VK_CHECK(vkCreateBuffer(device, &create_vertex_buffer, nullptr, &vertex_buffer.buf));
-
-    // Get the size and type requirements for memory containing this buffer
-    vkGetBufferMemoryRequirements(device, vertex_buffer.buf, &memory_req);
-
-    // Create a new GPU accessible memory for vertices
-    memory_alloc.allocationSize = memory_req.size;
-    memory_alloc.memoryTypeIndex = getMemoryTypeIndex(memory_req.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-    VK_CHECK(vkAllocateMemory(device, &memory_alloc, nullptr, &vertex_buffer.mem));
-    VK_CHECK(vkBindBufferMemory(device, vertex_buffer.buf, vertex_buffer.mem, 0));
-
-    // This buffer will be used as the source of a transfer to a
-    // GPU-addressable buffer
-    VkBufferCreateInfo create_index_buffer = {};
-    create_index_buffer.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    create_index_buffer.pNext = nullptr;
-    create_index_buffer.usage = VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
-
-    // Create a buffer representing indices on the GPU
-    create_index_buffer.size = sizeof(indices);
-    VK_CHECK(vkCreateBuffer(device, &create_index_buffer, nullptr, &index_buffer.buf));
-
-    // Get the size and type requirements for memory containing this buffer
-    vkGetBufferMemoryRequirements(device, index_buffer.buf, &memory_req);
-
-    // Create a new GPU accessible memory for indices
-    memory_alloc.allocationSize = memory_req.size;
-    memory_alloc.memoryTypeIndex = getMemoryTypeIndex(memory_req.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-    VK_CHECK(vkAllocateMemory(device, &memory_alloc, nullptr, &index_buffer.mem));
-    VK_CHECK(vkBindBufferMemory(device, index_buffer.buf, index_buffer.mem, 0));
-
-    // Copy from staging to the GPU-local buffers
-    VkCommandBuffer commands = getCommandBuffer(true);
-    VkBufferCopy copy = {};
-    copy.size = sizeof(vertices);
-    vkCmdCopyBuffer(commands, vertex_staging.buf, vertex_buffer.buf, 1, &copy);
-    copy.size = sizeof(indices);
-    vkCmdCopyBuffer(commands, index_staging.buf, index_buffer.buf, 1, &copy);
-    flushCommandBuffer(commands);
-
-    vkDestroyBuffer(device, vertex_staging.buf, nullptr);
-    vkDestroyBuffer(device, index_staging.buf, nullptr);
-    vkFreeMemory(device, vertex_staging.mem, nullptr);
-    vkFreeMemory(device, index_staging.mem, nullptr);
-}
-
-void init_vulkan()
-{
-    print_implementation_information();
-    create_instance(&instance);
-    // get physical device surface support functions
-    // get swapchain functions
-    choose_physical_device(instance, &physical_device);
-    vkGetPhysicalDeviceMemoryProperties(physical_device, &memory_properties);
-
-    uint32_t queue_family_count;
-    vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &queue_family_count, nullptr);
-    std::unique_ptr<VkQueueFamilyProperties[]> queue_families(new VkQueueFamilyProperties[queue_family_count]);
-    vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &queue_family_count, queue_families.get());
-    for(int i = 0; i < queue_family_count; i++) {
-        if(queue_families[i].queueFlags & VK_QUEUE_GRAPHICS_BIT) {
-                preferred_queue_family = i;
-        }
-    }
-
-    if(preferred_queue_family == NO_QUEUE_FAMILY) {
-        std::cerr << "no desired queue family was found\n";
-	exit(EXIT_FAILURE);
-    }
-
-    if(be_noisy) {
-        print_device_information(physical_device);
-    }
-    create_device(physical_device, &device);
-}
-
-void prepare_vulkan()
-{
-    create_vertex_buffers(vertices, sizeof(vertices), indices, sizeof(indices));
-
-    // Create Vertex Buffer;
-    VkBufferDeviceAddressInfo vertexBufferDeviceAddressInfo = { VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO, nullptr, vertex_buffer.buf };
-    VkDeviceAddress vertexBufferDeviceAddress = vkGetBufferDeviceAddress(device, &vertexBufferDeviceAddressInfo);
-
-    VkBufferDeviceAddressInfo indexBufferDeviceAddressInfo = { VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO, nullptr, index_buffer.buf };
-    VkDeviceAddress indexBufferDeviceAddress = vkGetBufferDeviceAddress(device, &indexBufferDeviceAddressInfo);
-
-
-    VkAccelerationStructureGeometryTrianglesDataKHR triangles = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR, nullptr};
-    triangles.vertexFormat = VK_FORMAT_R32G32B32_SFLOAT;
-    triangles.vertexData.deviceAddress = vertexBufferDeviceAddress;
-    triangles.vertexStride = sizeof(Vertex);
-    triangles.maxVertex = 2;
-    triangles.indexType = VK_INDEX_TYPE_UINT32;
-    triangles.indexData.deviceAddress = indexBufferDeviceAddress;
-    triangles.transformData.hostAddress = 0;
-
-    VkAccelerationStructureGeometryKHR geometries[1];
-
-    geometries[0] = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR, nullptr };
-    geometries[0].geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR;
-    geometries[0].geometry.triangles = triangles;
-    geometries[0].flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
-
-    VkAccelerationStructureBuildGeometryInfoKHR buildInfo { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR, nullptr };
-
-    buildInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
-    buildInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
-    buildInfo.srcAccelerationStructure = VK_NULL_HANDLE;
-    buildInfo.dstAccelerationStructure = VK_NULL_HANDLE;
-    buildInfo.geometryCount = 1;
-    buildInfo.pGeometries = geometries;
-    buildInfo.ppGeometries = nullptr;
-    buildInfo.scratchData.deviceAddress = 0;
-
-    auto getAccelerationStructureBuildSizes = (PFN_vkGetAccelerationStructureBuildSizesKHR)vkGetInstanceProcAddr(instance, "vkGetAccelerationStructureBuildSizesKHR");
-    assert(getAccelerationStructureBuildSizes);
-
-    uint32_t maxPrimitiveCounts[] = { 0 };
-    VkAccelerationStructureBuildSizesInfoKHR sizeInfo { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR, nullptr };
-    getAccelerationStructureBuildSizes(device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &buildInfo, maxPrimitiveCounts, &sizeInfo);
-
-    std::cout << "sizeInfo.accelerationStructureSize = " << sizeInfo.accelerationStructureSize << "\n";
-    std::cout << "sizeInfo.updateScratchSize = " << sizeInfo.updateScratchSize << "\n";
-    std::cout << "sizeInfo.buildScratchSize = " << sizeInfo.buildScratchSize << "\n";
-
-    // Create Scratch Buffer;
-
-    // vkCreateAccelerationStructureKHR(...)
-
-    // create swapchain
-    // create descriptor sets
-    // load shader modules
-    // create pipeline layout
-    // create pipeline
-
-}
-
-void cleanup_vulkan()
-{
-#if 0
-    VkDestroyPipeline(device, pipeline, nullptr);
-    VkDestroyPipelineLayout(device, pipeline_layout, nullptr);
-    VkDestroyDescriptorSetLayout(device, descriptor_set_layout, nullptr);
-
-    VkDestroyBuffer(device, vertex_buffer, nullptr);
-    VkFreeMemory(device, vertex_memory, nullptr);
-
-    VkDestroyBuffer(device, index_buffer, nullptr);
-    VkFreeMemory(device, index_memory, nullptr);
-
-    VkDestroyBuffer(device, vs_uniform_block_buffer, nullptr);
-    VkFreeMemory(device, vs_uniform_block_memory, nullptr);
-
-    VkDestroySemaphore(device, present_complete, nullptr);
-    VkDestroySemaphore(device, render_complete, nullptr);
-
-    for(auto& f : wait_fences)
-	VkDestroyFence(device, f, nullptr);
-#endif
-}
-
-static void error_callback(int error, const char* description)
-{
-    fprintf(stderr, "GLFW: %s\n", description);
-}
-
-bool quit = false;
-
-void key_callback(GLFWwindow *window, int key, int scancode, int action, int mods)
-{
-    if(action == GLFW_PRESS) {
-        switch(key) {
-            case 'Q': case '\033':
-                glfwSetWindowShouldClose(window, GL_TRUE);
-                break;
-
-            case 'S':
-                // screenshot("color.ppm", nullptr);
-                break;
-        }
-    }
-}
-
-void draw_frame(void)
-{
-    // start command buffer
-    // enqueue ray-trace commands
-    // vkB
-    // vkCmdTraceRays(commandBuffer, raygenShaderBindingTable, missShaderBindingTable, hitShaderBindingTable, callableShaderBindingTable, 512, 512, 1);
-    // end command buffer
-    // enqueue command buffer for graphics
-    // copy to present
-}
-
-int main(int argc, char **argv)
-{
-    be_noisy = (getenv("BE_NOISY") != NULL);
-    enable_validation = (getenv("VALIDATE") != NULL);
-
-    glfwSetErrorCallback(error_callback);
-
-    if(!glfwInit()) {
-        std::cerr << "GLFW initialization failed.\n";
-        exit(EXIT_FAILURE);
-    }
-
-    if (!glfwVulkanSupported()) {
-        std::cerr << "GLFW reports Vulkan is not supported\n";
-        exit(EXIT_FAILURE);
-    }
-
-    init_vulkan();
-
-    glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
-    GLFWwindow* window = glfwCreateWindow(512, 512, "vulkan test", NULL, NULL);
-
-    glfwSetKeyCallback(window, key_callback);
-
-    VkResult err = glfwCreateWindowSurface(instance, window, NULL, &surface);
-    if (err) {
-        std::cerr << "GLFW window creation failed " << err << "\n";
-        exit(EXIT_FAILURE);
-    }
-	
-    PFN_vkCmdTraceRaysKHR cmdTraceRaysKHR = (PFN_vkCmdTraceRaysKHR)vkGetInstanceProcAddr(instance, "vkCmdTraceRaysKHR");
-    assert(cmdTraceRaysKHR);
-
-    prepare_vulkan();
-
-    while (!glfwWindowShouldClose(window)) {
-
-        draw_frame();
-
-        glfwPollEvents();
-    }
-
-    cleanup_vulkan();
-}
-
+#include <iostream>
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include <map>
+#include <set>
+#include <string>
+#include <fstream>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <chrono>
+#include <tuple>
+
+#include <cstring>
+#include <cctype>
+#include <cstddef>
+#include <cassert>
+#include <cmath>
+#include <cfloat>
+#include <cerrno>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#include <vulkan/vulkan.h>
+#include <GLFW/glfw3.h>
+
+#include "shader_bundle.h"
+
+#if defined(_WIN32)
+#define PLATFORM_WINDOWS
+// Windows supported
+#elif defined(__linux__)
+#define PLATFORM_LINUX
+// Linux supported
+#elif defined(__APPLE__) && defined(__MACH__)
+// MacOS not supported yet but want to get to runtime
+#define PLATFORM_MOLTENVK
+#else
+#error Platform not supported.
+#endif
+
+#define DEFAULT_FENCE_TIMEOUT 100000000000
+
+VkInstance instance;
+VkPhysicalDevice physical_device;
+const uint32_t NO_QUEUE_FAMILY = 0xffffffff;
+uint32_t preferred_queue_family = NO_QUEUE_FAMILY;
+VkDevice device;
+VkPhysicalDeviceMemoryProperties memory_properties;
+
+// Memory the host writes and the GPU reads in place.  Device-local when
+// the device exposes host-visible VRAM (resizable BAR, or the 256MB
+// window most discrete GPUs have), so small and per-frame data needs no
+// staging copy or submit; otherwise ordinary host memory.
+VkMemoryPropertyFlags direct_write_properties = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+VkDeviceSize direct_write_limit = 0;     // largest static upload written in place instead of staged
+VkQueue queue;
+
+// Every submission signals the next value of one timeline semaphore, so
+// waiting for GPU work is a value comparison rather than a fence per submit
+VkSemaphore gpu_timeline;
+uint64_t gpu_timeline_submitted = 0;    // guarded by queue_mutex
+
+VkSurfaceKHR surface;
+
+// Every device-level entry point the program calls, loaded straight from
+// the driver with vkGetDeviceProcAddr so calls skip the loader's
+// trampolines.  Call them as vkd.CmdDispatch(...) and so on.
+#define DEVICE_FUNCTIONS(F) \
+    F(AllocateCommandBuffers, "Vulkan 1.0") \
+    F(AllocateDescriptorSets, "Vulkan 1.0") \
+    F(AllocateMemory, "Vulkan 1.0") \
+    F(BeginCommandBuffer, "Vulkan 1.0") \
+    F(BindBufferMemory, "Vulkan 1.0") \
+    F(BindImageMemory, "Vulkan 1.0") \
+    F(CmdBindDescriptorSets, "Vulkan 1.0") \
+    F(CmdBindPipeline, "Vulkan 1.0") \
+    F(CmdCopyBuffer, "Vulkan 1.0") \
+    F(CmdCopyImageToBuffer, "Vulkan 1.0") \
+    F(CmdDispatch, "Vulkan 1.0") \
+    F(CmdFillBuffer, "Vulkan 1.0") \
+    F(CmdPipelineBarrier, "Vulkan 1.0") \
+    F(CmdPushConstants, "Vulkan 1.0") \
+    F(CmdResetQueryPool, "Vulkan 1.0") \
+    F(CmdUpdateBuffer, "Vulkan 1.0") \
+    F(CreateBuffer, "Vulkan 1.0") \
+    F(CreateCommandPool, "Vulkan 1.0") \
+    F(CreateComputePipelines, "Vulkan 1.0") \
+    F(CreateDescriptorPool, "Vulkan 1.0") \
+    F(CreateDescriptorSetLayout, "Vulkan 1.0") \
+    F(CreateImage, "Vulkan 1.0") \
+    F(CreateImageView, "Vulkan 1.0") \
+    F(CreatePipelineCache, "Vulkan 1.0") \
+    F(CreatePipelineLayout, "Vulkan 1.0") \
+    F(CreateQueryPool, "Vulkan 1.0") \
+    F(CreateSemaphore, "Vulkan 1.0") \
+    F(CreateShaderModule, "Vulkan 1.0") \
+    F(DestroyBuffer, "Vulkan 1.0") \
+    F(DestroyCommandPool, "Vulkan 1.0") \
+    F(DestroyDescriptorPool, "Vulkan 1.0") \
+    F(DestroyDescriptorSetLayout, "Vulkan 1.0") \
+    F(DestroyImage, "Vulkan 1.0") \
+    F(DestroyImageView, "Vulkan 1.0") \
+    F(DestroyPipeline, "Vulkan 1.0") \
+    F(DestroyPipelineCache, "Vulkan 1.0") \
+    F(DestroyPipelineLayout, "Vulkan 1.0") \
+    F(DestroyQueryPool, "Vulkan 1.0") \
+    F(DestroySemaphore, "Vulkan 1.0") \
+    F(DestroyShaderModule, "Vulkan 1.0") \
+    F(DeviceWaitIdle, "Vulkan 1.0") \
+    F(EndCommandBuffer, "Vulkan 1.0") \
+    F(FreeCommandBuffers, "Vulkan 1.0") \
+    F(FreeMemory, "Vulkan 1.0") \
+    F(GetBufferMemoryRequirements, "Vulkan 1.0") \
+    F(GetDeviceQueue, "Vulkan 1.0") \
+    F(GetImageMemoryRequirements, "Vulkan 1.0") \
+    F(GetPipelineCacheData, "Vulkan 1.0") \
+    F(GetQueryPoolResults, "Vulkan 1.0") \
+    F(InvalidateMappedMemoryRanges, "Vulkan 1.0") \
+    F(MapMemory, "Vulkan 1.0") \
+    F(QueueSubmit, "Vulkan 1.0") \
+    F(UnmapMemory, "Vulkan 1.0") \
+    F(UpdateDescriptorSets, "Vulkan 1.0") \
+    F(GetBufferDeviceAddress, "Vulkan 1.2") \
+    F(WaitSemaphores, "Vulkan 1.2") \
+    F(GetSemaphoreCounterValue, "Vulkan 1.2") \
+    F(GetAccelerationStructureBuildSizesKHR, VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME) \
+    F(CreateAccelerationStructureKHR, VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME) \
+    F(DestroyAccelerationStructureKHR, VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME) \
+    F(GetAccelerationStructureDeviceAddressKHR, VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME) \
+    F(CmdBuildAccelerationStructuresKHR, VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME) \
+    F(BuildAccelerationStructuresKHR, VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME) \
+    F(CmdWriteAccelerationStructuresPropertiesKHR, VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME) \
+    F(WriteAccelerationStructuresPropertiesKHR, VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME) \
+    F(CmdCopyAccelerationStructureToMemoryKHR, VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME) \
+    F(CmdCopyMemoryToAccelerationStructureKHR, VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME) \
+    F(GetDeviceAccelerationStructureCompatibilityKHR, VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME) \
+    F(CreateRayTracingPipelinesKHR, VK_KHR_RAY_TRACING_PIPELINE_EXTENSION_NAME) \
+    F(GetRayTracingShaderGroupHandlesKHR, VK_KHR_RAY_TRACING_PIPELINE_EXTENSION_NAME) \
+    F(CmdTraceRaysKHR, VK_KHR_RAY_TRACING_PIPELINE_EXTENSION_NAME) \
+    F(CmdTraceRaysIndirectKHR, VK_KHR_RAY_TRACING_PIPELINE_EXTENSION_NAME) \
+    F(CreateDeferredOperationKHR, VK_KHR_DEFERRED_HOST_OPERATIONS_EXTENSION_NAME) \
+    F(DestroyDeferredOperationKHR, VK_KHR_DEFERRED_HOST_OPERATIONS_EXTENSION_NAME) \
+    F(GetDeferredOperationMaxConcurrencyKHR, VK_KHR_DEFERRED_HOST_OPERATIONS_EXTENSION_NAME) \
+    F(GetDeferredOperationResultKHR, VK_KHR_DEFERRED_HOST_OPERATIONS_EXTENSION_NAME) \
+    F(DeferredOperationJoinKHR, VK_KHR_DEFERRED_HOST_OPERATIONS_EXTENSION_NAME) \
+    F(CmdPipelineBarrier2KHR, VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME)
+
+struct device_dispatch_table {
+#define DECLARE_DEVICE_FUNCTION(name, source) PFN_vk##name name = nullptr;
+    DEVICE_FUNCTIONS(DECLARE_DEVICE_FUNCTION)
+#undef DECLARE_DEVICE_FUNCTION
+};
+
+device_dispatch_table vkd;
+
+#ifdef PLATFORM_MACOS
+void *window;
+#endif // PLATFORM_MACOS
+
+bool be_noisy = true;
+bool enable_validation = false;
+
+// Offline modes (tiled output, batch, server and their device processes)
+// never open a window, so they skip GLFW and the surface and swapchain
+// extensions and can run on machines without a display
+bool headless = false;
+bool dump_vulkan_calls = false;
+
+// STARTUP_TIMING prints how long each phase of initialization took
+bool print_startup_timing = false;
+std::chrono::steady_clock::time_point startup_phase_started = std::chrono::steady_clock::now();
+
+void end_startup_phase(const char *name)
+{
+    auto now = std::chrono::steady_clock::now();
+    if(print_startup_timing) {
+        printf("startup: %-16s %8.2f ms\n", name, std::chrono::duration<double, std::milli>(now - startup_phase_started).count());
+    }
+    startup_phase_started = now;
+}
+
+struct Vertex
+{
+    float v[3];
+    float c[3];
+};
+
+// geometry data
+Vertex vertices[3] = {
+    {{0, 0, 0}, {1, 0, 0}},
+    {{1, 0, 0}, {0, 1, 0}},
+    {{0, 1, 0}, {0, 0, 1}},
+};
+uint32_t indices[3] = {0, 1, 2}; 
+
+Vertex quad_vertices[4] = {
+    {{-.5, 0, -.5}, {.2, .6, .2}},
+    {{ .5, 0, -.5}, {.2, .6, .2}},
+    {{ .5, 0,  .5}, {.1, .4, .1}},
+    {{-.5, 0,  .5}, {.1, .4, .1}},
+};
+uint32_t quad_indices[6] = {0, 1, 2, 0, 2, 3};
+
+struct buffer {
+    VkDeviceMemory mem;
+    VkBuffer buf;
+};
+
+struct acceleration_structure {
+    buffer storage;
+    VkAccelerationStructureKHR as = VK_NULL_HANDLE;
+    VkDeviceAddress address = 0;
+    VkDeviceSize size = 0;
+};
+
+// One per unique piece of geometry; every placement of the mesh shares
+// this BLAS through an instance record in the TLAS
+struct upload_batch;
+
+struct mesh {
+    buffer vertex_buffer;
+    buffer index_buffer;
+    uint32_t vertex_count;
+    uint32_t triangle_count;
+    acceleration_structure blas;
+    float bounds_min[3];
+    float bounds_max[3];
+    float radius;               // of the bounding sphere around the origin
+    std::vector<uint32_t> lods; // coarser versions of this mesh, finest first
+
+    // Residency: an evicted mesh keeps its slot (the index is baked into
+    // instance records) and comes back from these host copies
+    std::vector<Vertex> host_vertices;
+    std::vector<uint32_t> host_indices;
+    std::vector<uint8_t> serialized_blas;   // filled the first time it is evicted
+    VkDeviceSize serialized_size = 0;       // of the resident BLAS, queried when it was built
+    bool resident = false;
+    upload_batch *uploading = nullptr;      // the batch bringing it back, until that finishes
+    bool in_scene = false;      // referenced by the current scene; others are forgotten once evicted
+    uint64_t last_used = 0;
+    VkDeviceSize device_bytes = 0;
+};
+
+// A deque so uploads and host builds in flight keep valid references
+// while streaming adds meshes
+std::deque<mesh> meshes;
+
+// Geometry is evicted least-recently-used first once the resident bytes
+// exceed the budget; 0 means "derive from the device-local heaps"
+VkDeviceSize geometry_budget = 0;
+VkDeviceSize geometry_resident_bytes = 0;
+uint64_t residency_clock = 0;
+bool memory_budget_supported = false;
+
+// Serialized BLASes only save rebuilds, so the least recently used are
+// dropped once they pass this many bytes of host memory
+VkDeviceSize serialized_blas_budget = 256 * 1024 * 1024;
+VkDeviceSize serialized_blas_bytes = 0;
+
+// Meshes already loaded, keyed by where they came from; a scene that
+// reuses a model skips loading it, and skips the upload and BLAS build
+// too unless it was evicted since
+std::map<std::string, uint32_t> mesh_cache;
+
+// BLASes can be built on the CPU, a deferred operation per mesh joined by
+// the workers, while the GPU runs the other uploads.  HOST_BUILDS=auto
+// takes small meshes when the GPU already has work queued and VRAM is
+// host-visible (host-built BLASes live in direct-write memory and are
+// traced in place); HOST_BUILDS=all takes every mesh it can.
+enum host_build_mode { HOST_BUILDS_OFF, HOST_BUILDS_AUTO, HOST_BUILDS_ALL };
+host_build_mode host_builds = HOST_BUILDS_OFF;
+uint32_t host_build_max_triangles = 64 * 1024;
+
+// Placements are kept only as the 64-byte records the TLAS build reads,
+// so a forest costs one instance record per tree, not one BLAS per tree
+static_assert(sizeof(VkAccelerationStructureInstanceKHR) == 64, "instance records must be 64 bytes");
+std::vector<VkAccelerationStructureInstanceKHR> instances;
+std::vector<uint32_t> instance_meshes;     // which mesh each record places
+
+// Instances of meshes with LODs switch to coarser ones as their projected
+// size shrinks: LOD 1 below LOD_PIXELS across, and one level per halving
+// after that.  The level each instance had is kept so a new choice only
+// wins once the size is well past the boundary, and instances near one
+// don't swap back and forth as the camera moves.
+const uint32_t LOD_UNCHOSEN = UINT32_MAX;
+std::vector<uint32_t> instance_lods;
+float lod_pixels = 256.0f;
+uint32_t max_lod_levels = 4;               // coarser levels generated per imported mesh
+
+// Host-visible, GPU-readable build input for the TLAS, kept mapped
+buffer instance_buffer;
+void *instance_buffer_mapped = nullptr;
+size_t instance_buffer_capacity = 0;
+
+acceleration_structure tlas;
+
+// Set when streaming or LOD changes have changed the instances; the next
+// frame rebuilds the TLAS and mesh table in its own command buffer rather
+// than the render thread stopping to wait for them
+bool scene_update_pending = false;
+
+VkPhysicalDeviceAccelerationStructurePropertiesKHR acceleration_structure_properties = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_PROPERTIES_KHR, nullptr };
+
+
+// Where closest-hit shaders find each mesh's geometry, indexed by the
+// instance custom index (always the index of the mesh the instance traces)
+struct mesh_info {
+    VkDeviceAddress vertices;
+    VkDeviceAddress indices;
+};
+
+buffer mesh_table;
+
+struct image {
+    VkImage img = VK_NULL_HANDLE;
+    VkDeviceMemory mem;
+    VkImageView view;
+    VkFormat format;
+    uint32_t width;
+    uint32_t height;
+};
+
+// Size of the GPU images; the frame may be larger, in which case it is
+// traced one region of at most this size at a time
+uint32_t image_width = 512;
+uint32_t image_height = 512;
+image output_image;
+
+uint32_t frame_width = 512;
+uint32_t frame_height = 512;
+
+// Part of the frame the GPU images currently hold
+struct frame_region {
+    uint32_t x, y;
+    uint32_t width, height;     // clipped to the frame
+};
+
+frame_region region = {0, 0, 512, 512};
+
+// Mirrors the push constant block in shaders/common.glsl
+struct camera_constants {
+    float position[4];
+    float right[4];
+    float up[4];
+    float forward[4];
+};
+
+camera_constants camera;
+
+// Mirrors the push constant block in shaders/common.glsl
+struct frame_constants {
+    camera_constants camera;
+    uint32_t frame_index;       // frames already accumulated; 0 starts over
+    uint32_t adaptive;          // trace the work list rather than every pixel
+    uint32_t region_offset[2];
+    uint32_t region_extent[2];
+    uint32_t frame_size[2];
+};
+
+// Mirror TONEMAP_* in shaders/tonemap.comp
+enum tone_operator {
+    TONEMAP_CLAMP,
+    TONEMAP_REINHARD,
+    TONEMAP_ACES,
+    TONEMAP_FILMIC,
+    TONEMAP_OPERATOR_COUNT,
+};
+
+const char *tone_operator_names[] = { "clamp", "reinhard", "aces", "filmic" };
+
+// What the user asked for; a variant is what the scene actually needs
+struct render_settings {
+    uint32_t max_bounces = 1;
+    uint32_t samples_per_pixel = 1;
+    bool any_hit_enabled = true;
+    float target_error = 0.02f;     // relative standard error of pixel luminance
+    uint32_t min_frames = 4;
+    uint32_t max_frames = 1024;
+    bool exit_on_convergence = false;
+    bool adaptive_sampling = true;      // after min_frames, only trace pixels still above target_error
+    uint32_t max_adaptive_samples = 8;  // per pixel per frame
+    uint32_t tone_operator = TONEMAP_ACES;
+    float exposure = 0.0f;              // stops
+    uint32_t output_bits = 8;           // 8 or 10
+};
+
+render_settings settings;
+
+// Frames are summed into accumulation_image until raygen's per-tile error
+// estimates all fall below the target, then tracing stops
+const uint32_t tile_size = 16;     // mirrors TILE_SIZE in shaders/common.glsl
+
+struct accumulation_state {
+    uint32_t frame_count = 0;
+    bool converged = false;
+    std::chrono::steady_clock::time_point started;
+};
+
+accumulation_state accumulation;
+image accumulation_image;
+image sample_count_image;       // samples accumulated per pixel
+buffer tile_errors;             // worst relative error per tile of the last frame
+float *tile_errors_mapped;
+uint32_t tile_count_x, tile_count_y;
+
+// Once accumulation has a usable variance estimate, a compute pass
+// appends every pixel still above target_error, with a sample count, to
+// work_list and counts them into the trace-rays indirect command at its
+// head; raygen then runs only over that list.
+struct work_list_header {
+    VkTraceRaysIndirectCommandKHR command;  // width is the entry count
+    uint32_t padding;
+};
+
+// Mirrors the push constant block in shaders/worklist.comp
+struct work_list_constants {
+    float target_error;
+    uint32_t max_samples;
+    uint32_t region_extent[2];
+};
+
+buffer work_list;
+VkPipeline work_list_pipeline;
+
+// raygen only accumulates; tonemap.comp turns the accumulated mean into
+// the output image, so LDR readback moves 4 bytes per pixel.  Mirrors its
+// push constant block.
+struct tonemap_constants {
+    float exposure_scale;
+    uint32_t tone_operator;
+    uint32_t region_extent[2];
+};
+
+VkPipeline tonemap_pipeline;
+bool tonemap_needed = false;        // settings changed since the output image was written
+
+// R8G8B8A8_UNORM or, for 10-bit output, A2B10G10R10_UNORM_PACK32; sRGB-encoded either way
+VkFormat output_format = VK_FORMAT_R8G8B8A8_UNORM;
+
+// Shared by the compute passes; push constants are sized for the larger block
+VkPipelineLayout compute_pipeline_layout;
+
+VkDescriptorSetLayout descriptor_set_layout;
+VkDescriptorPool descriptor_pool;
+VkDescriptorSet descriptor_set;
+VkPipelineLayout pipeline_layout;
+VkPipelineCache pipeline_cache;
+
+// Created from the embedded shader bundle on first use and shared by
+// every library, pipeline and variant; keyed by SPIR-V hash so
+// identical shaders share a module
+std::map<uint64_t, VkShaderModule> shader_modules;
+
+VkPhysicalDeviceRayTracingPipelinePropertiesKHR ray_tracing_pipeline_properties = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_PROPERTIES_KHR, nullptr };
+
+
+#if 0
+
+VkDeviceMemory vs_uniform_block_memory;
+VkBuffer vs_uniform_block_buffer;
+VkDescriptorBufferInfo vs_uniform_block_descriptor;
+
+struct {
+    float projection[16];
+    float model[16];
+    float view[16];
+};
+
+VkPipelineLayout pipeline_layout;
+VkPipeline pipeline;
+VkDescriptorSetLayout descriptor_set_layout;
+VkDescriptorSet descriptor_set;
+
+VkSemaphore present_complete;
+VkSemaphore render_complete;
+std::Vector<VkFence> wait_fences;
+
+#endif
+
+#define STR(f) #f
+
+std::map<VkResult, std::string> vkresult_name_map =
+{
+    {VK_ERROR_OUT_OF_HOST_MEMORY, "OUT_OF_HOST_MEMORY"},
+    {VK_ERROR_OUT_OF_DEVICE_MEMORY, "OUT_OF_DEVICE_MEMORY"},
+    {VK_ERROR_INITIALIZATION_FAILED, "INITIALIZATION_FAILED"},
+    {VK_ERROR_DEVICE_LOST, "DEVICE_LOST"},
+    {VK_ERROR_MEMORY_MAP_FAILED, "MEMORY_MAP_FAILED"},
+    {VK_ERROR_LAYER_NOT_PRESENT, "LAYER_NOT_PRESENT"},
+    {VK_ERROR_EXTENSION_NOT_PRESENT, "EXTENSION_NOT_PRESENT"},
+    {VK_ERROR_FEATURE_NOT_PRESENT, "FEATURE_NOT_PRESENT"},
+    {VK_PIPELINE_COMPILE_REQUIRED, "PIPELINE_COMPILE_REQUIRED"},
+};
+
+#define VK_CHECK(f) \
+{ \
+    VkResult result = (f); \
+    if(result != VK_SUCCESS) { \
+	if(vkresult_name_map.count(f) > 0) { \
+	    std::cerr << "VkResult from " STR(f) " was " << vkresult_name_map[result] << " at line " << __LINE__ << "\n"; \
+	} \
+	else \
+	    std::cerr << "VkResult from " STR(f) " was " << result << " at line " << __LINE__ << "\n"; \
+	exit(EXIT_FAILURE); \
+    } \
+}
+
+// Fixed set of worker threads running jobs in FIFO order
+struct thread_pool
+{
+    std::vector<std::thread> threads;
+    std::deque<std::function<void()>> jobs;
+    std::mutex mutex;
+    std::condition_variable job_available;
+    std::condition_variable job_taken;
+    size_t max_queued;      // submit() blocks while this many jobs wait; 0 is unbounded
+    bool stopping = false;
+
+    thread_pool(unsigned int count, size_t max_queued = 0) :
+        max_queued(max_queued)
+    {
+        for(unsigned int i = 0; i < count; i++) {
+            threads.emplace_back([this]() { run(); });
+        }
+    }
+
+    ~thread_pool()
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        job_available.notify_all();
+        for(auto& t : threads)
+            t.join();
+    }
+
+    void submit(std::function<void()> job)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            job_taken.wait(lock, [this]() { return max_queued == 0 || jobs.size() < max_queued; });
+            jobs.push_back(job);
+        }
+        job_available.notify_one();
+    }
+
+    void run()
+    {
+        while(true) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                job_available.wait(lock, [this]() { return stopping || !jobs.empty(); });
+                if(stopping && jobs.empty())
+                    return;
+                job = jobs.front();
+                jobs.pop_front();
+            }
+            job_taken.notify_one();
+            job();
+        }
+    }
+
+    unsigned int size() const { return threads.size(); }
+};
+
+std::unique_ptr<thread_pool> workers;
+
+// Run body(0) .. body(count - 1) on the workers and this thread and return
+// once all are done; this thread keeps taking items, so it finishes even
+// while the workers are busy with something else
+void parallel_for(size_t count, std::function<void(size_t)> body)
+{
+    struct shared_state {
+        std::atomic<size_t> next{0};
+        std::mutex mutex;
+        std::condition_variable finished;
+        size_t done = 0;
+    };
+    auto state = std::make_shared<shared_state>();
+    auto work = [state, count, body]() {
+        for(size_t i = state->next++; i < count; i = state->next++) {
+            body(i);
+            std::lock_guard<std::mutex> lock(state->mutex);
+            if(++state->done == count) {
+                state->finished.notify_all();
+            }
+        }
+    };
+
+    size_t helpers = std::min(count - 1, (size_t)workers->size());
+    for(size_t i = 0; i < helpers; i++) {
+        workers->submit(work);
+    }
+    work();
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->finished.wait(lock, [&]() { return state->done == count; });
+}
+
+
+void print_implementation_information()
+{
+    uint32_t ext_count;
+    vkEnumerateInstanceExtensionProperties(nullptr, &ext_count, nullptr);
+    std::unique_ptr<VkExtensionProperties[]> exts(new VkExtensionProperties[ext_count]);
+    vkEnumerateInstanceExtensionProperties(nullptr, &ext_count, exts.get());
+    printf("Vulkan instance extensions:\n");
+    for(int i = 0; i < ext_count; i++)
+        printf("    (%08X) %s\n", exts[i].specVersion, exts[i].extensionName);
+}
+
+void create_instance(VkInstance* instance)
+{
+    std::set<std::string> extension_set;
+    std::set<std::string> layer_set;
+
+    if(!headless) {
+        uint32_t glfw_reqd_extension_count;
+        const char** glfw_reqd_extensions = glfwGetRequiredInstanceExtensions(&glfw_reqd_extension_count);
+        for(int i = 0; i < glfw_reqd_extension_count; i++) {
+            extension_set.insert(glfw_reqd_extensions[i]);
+        }
+
+        extension_set.insert(VK_KHR_SURFACE_EXTENSION_NAME);
+#if defined(PLATFORM_WINDOWS)
+        extension_set.insert("VK_KHR_win32_surface");
+#elif defined(PLATFORM_LINUX)
+        extension_set.insert("VK_KHR_xcb_surface");
+#elif defined(PLATFORM_MACOS)
+        extension_set.insert("VK_MVK_macos_surface");
+#endif
+    }
+
+    if(enable_validation) {
+	layer_set.insert("VK_LAYER_KHRONOS_validation");
+    }
+    if(dump_vulkan_calls) {
+	layer_set.insert("VK_LAYER_LUNARG_api_dump");
+    }
+
+    {
+        std::vector<const char*> extensions;
+        std::vector<const char*> layers;
+	// Careful - only valid for duration of sets where contents have not changed
+	for(auto& s: extension_set)
+	    extensions.push_back(s.c_str());
+
+	for(auto& s: layer_set)
+	    layers.push_back(s.c_str());
+
+	VkApplicationInfo app_info = {};
+	app_info.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
+	app_info.pApplicationName = "triangle";
+	app_info.pEngineName = "triangle";
+	app_info.apiVersion = VK_API_VERSION_1_2;
+
+	VkInstanceCreateInfo create = {};
+	create.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+	create.pNext = NULL;
+	create.pApplicationInfo = &app_info;
+	create.enabledExtensionCount = extensions.size();
+	create.ppEnabledExtensionNames = extensions.data();
+	create.enabledLayerCount = layers.size();
+	create.ppEnabledLayerNames = layers.data();
+
+	VK_CHECK(vkCreateInstance(&create, nullptr, instance));
+    }
+}
+
+const char* device_types[] = {
+    "other",
+    "integrated GPU",
+    "discrete GPU",
+    "virtual GPU",
+    "CPU",
+    "unknown",
+};
+
+// Everything create_device enables unconditionally; a device missing any
+// of these can't run the renderer at all.  Windowed runs need the
+// swapchain as well.
+const char* required_device_extensions[] = {
+    VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME,
+    VK_KHR_RAY_TRACING_PIPELINE_EXTENSION_NAME,
+    VK_KHR_RAY_QUERY_EXTENSION_NAME,
+    VK_KHR_DEFERRED_HOST_OPERATIONS_EXTENSION_NAME,
+    VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME,
+    VK_KHR_SYNCHRONIZATION_2_EXTENSION_NAME,
+};
+
+// Features create_device enables unconditionally, as (structure in
+// device_features, member); a device lacking any of them is passed over
+#define REQUIRED_DEVICE_FEATURES(F) \
+    F(core.features, shaderStorageImageWriteWithoutFormat) \
+    F(vulkan_1_2, bufferDeviceAddress) \
+    F(vulkan_1_2, scalarBlockLayout) \
+    F(vulkan_1_2, timelineSemaphore) \
+    F(synchronization_2, synchronization2) \
+    F(acceleration_structure, accelerationStructure) \
+    F(ray_tracing_pipeline, rayTracingPipeline) \
+    F(ray_tracing_pipeline, rayTracingPipelineTraceRaysIndirect) \
+    F(ray_query, rayQuery)
+
+// The feature structures the renderer queries and enables, linked by
+// chain() for vkGetPhysicalDeviceFeatures2 or vkCreateDevice
+struct device_features {
+    VkPhysicalDeviceFeatures2 core = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2, nullptr };
+    VkPhysicalDeviceVulkan12Features vulkan_1_2 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES, nullptr };
+    VkPhysicalDeviceSynchronization2FeaturesKHR synchronization_2 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SYNCHRONIZATION_2_FEATURES_KHR, nullptr };
+    VkPhysicalDeviceAccelerationStructureFeaturesKHR acceleration_structure = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_FEATURES_KHR, nullptr };
+    VkPhysicalDeviceRayTracingPipelineFeaturesKHR ray_tracing_pipeline = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_FEATURES_KHR, nullptr };
+    VkPhysicalDeviceRayQueryFeaturesKHR ray_query = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_QUERY_FEATURES_KHR, nullptr };
+
+    // Copies keep the old links, so this is called again before every use
+    VkPhysicalDeviceFeatures2* chain()
+    {
+        core.pNext = &vulkan_1_2;
+        vulkan_1_2.pNext = &synchronization_2;
+        synchronization_2.pNext = &acceleration_structure;
+        acceleration_structure.pNext = &ray_tracing_pipeline;
+        ray_tracing_pipeline.pNext = &ray_query;
+        ray_query.pNext = nullptr;
+        return &core;
+    }
+};
+
+// Everything startup needs to know about a physical device, queried once
+// while choosing it and read from here afterwards
+struct device_capabilities {
+    VkPhysicalDevice physical_device = VK_NULL_HANDLE;
+    VkPhysicalDeviceProperties properties;
+    VkPhysicalDeviceRayTracingPipelinePropertiesKHR ray_tracing_pipeline = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_PROPERTIES_KHR, nullptr };
+    VkPhysicalDeviceAccelerationStructurePropertiesKHR acceleration_structure = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_PROPERTIES_KHR, nullptr };
+    device_features features;
+    VkPhysicalDeviceMemoryProperties memory;
+    std::vector<VkExtensionProperties> extensions;
+    std::vector<VkQueueFamilyProperties> queue_families;
+    uint8_t uuid[VK_UUID_SIZE];
+
+    bool has_extension(const char *name) const
+    {
+        return std::any_of(extensions.begin(), extensions.end(), [&](const VkExtensionProperties& e) { return strcmp(e.extensionName, name) == 0; });
+    }
+};
+
+// Of the device in use
+device_capabilities capabilities;
+
+struct device_candidate {
+    device_capabilities caps;
+    VkDeviceSize device_local_bytes;
+    std::string missing;            // first requirement it lacks, if any
+    uint64_t score;
+};
+
+std::string format_uuid(const uint8_t uuid[VK_UUID_SIZE])
+{
+    char text[2 * VK_UUID_SIZE + 5];
+    char *p = text;
+    for(int i = 0; i < VK_UUID_SIZE; i++) {
+        if(i == 4 || i == 6 || i == 8 || i == 10) {
+            *p++ = '-';
+        }
+        p += sprintf(p, "%02x", uuid[i]);
+    }
+    return text;
+}
+
+device_candidate describe_device_candidate(VkPhysicalDevice physical_device)
+{
+    device_candidate c;
+    device_capabilities& caps = c.caps;
+    caps.physical_device = physical_device;
+
+    uint32_t ext_count;
+    VK_CHECK(vkEnumerateDeviceExtensionProperties(physical_device, nullptr, &ext_count, nullptr));
+    caps.extensions.resize(ext_count);
+    VK_CHECK(vkEnumerateDeviceExtensionProperties(physical_device, nullptr, &ext_count, caps.extensions.data()));
+    for(const char *required : required_device_extensions) {
+        if(!caps.has_extension(required) && c.missing.empty()) {
+            c.missing = required;
+        }
+    }
+    if(!headless && !caps.has_extension(VK_KHR_SWAPCHAIN_EXTENSION_NAME) && c.missing.empty()) {
+        c.missing = VK_KHR_SWAPCHAIN_EXTENSION_NAME;
+    }
+
+    uint32_t queue_family_count;
+    vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &queue_family_count, nullptr);
+    caps.queue_families.resize(queue_family_count);
+    vkGetPhysicalDeviceQueueFamilyProperties(physical_device, &queue_family_count, caps.queue_families.data());
+    bool has_graphics = std::any_of(caps.queue_families.begin(), caps.queue_families.end(), [](const VkQueueFamilyProperties& q) { return (q.queueFlags & VK_QUEUE_GRAPHICS_BIT) != 0; });
+    if(!has_graphics && c.missing.empty()) {
+        c.missing = "a graphics queue";
+    }
+
+    // Only chain the ray tracing properties where the structures are known
+    VkPhysicalDeviceIDProperties id = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES, nullptr };
+    if(c.missing.empty()) {
+        id.pNext = &caps.ray_tracing_pipeline;
+        caps.ray_tracing_pipeline.pNext = &caps.acceleration_structure;
+    }
+    VkPhysicalDeviceProperties2 properties2 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2, &id };
+    vkGetPhysicalDeviceProperties2(physical_device, &properties2);
+    caps.ray_tracing_pipeline.pNext = nullptr;
+    caps.properties = properties2.properties;
+    memcpy(caps.uuid, id.deviceUUID, VK_UUID_SIZE);
+
+    // Feature structures of missing extensions can't be chained either
+    if(c.missing.empty()) {
+        vkGetPhysicalDeviceFeatures2(physical_device, caps.features.chain());
+#define CHECK_DEVICE_FEATURE(structure, feature) \
+        if(!caps.features.structure.feature && c.missing.empty()) { \
+            c.missing = #feature; \
+        }
+        REQUIRED_DEVICE_FEATURES(CHECK_DEVICE_FEATURE)
+#undef CHECK_DEVICE_FEATURE
+    }
+
+    vkGetPhysicalDeviceMemoryProperties(physical_device, &caps.memory);
+    c.device_local_bytes = 0;
+    for(uint32_t i = 0; i < caps.memory.memoryHeapCount; i++) {
+        if(caps.memory.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) {
+            c.device_local_bytes += caps.memory.memoryHeaps[i].size;
+        }
+    }
+
+    // Device type dominates, then memory (in MB), then recursion depth
+    uint64_t type_rank = 0;
+    switch(caps.properties.deviceType) {
+        case VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU: type_rank = 4; break;
+        case VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU: type_rank = 3; break;
+        case VK_PHYSICAL_DEVICE_TYPE_VIRTUAL_GPU: type_rank = 2; break;
+        case VK_PHYSICAL_DEVICE_TYPE_CPU: type_rank = 1; break;
+        default: type_rank = 0; break;
+    }
+    uint64_t megabytes = std::min<uint64_t>(c.device_local_bytes >> 20, (1ull << 32) - 1);
+    c.score = (type_rank << 48) | (megabytes << 8) | std::min(255u, caps.ray_tracing_pipeline.maxRayRecursionDepth);
+    return c;
+}
+
+std::string lowercase(const std::string& s)
+{
+    std::string lowered;
+    for(char ch : s) {
+        lowered += tolower(ch);
+    }
+    return lowered;
+}
+
+bool is_decimal(const std::string& s)
+{
+    return !s.empty() && std::all_of(s.begin(), s.end(), ::isdigit);
+}
+
+// VKRT_DEVICE picks a device by enumeration index ("index:1", or a bare
+// "1" if there are that many devices), by UUID (as printed below, dashes
+// optional) or by a case-insensitive substring of its name.  A bare number
+// past the last index is matched against names, so "3090" finds an RTX 3090.
+bool device_matches(const device_candidate& c, uint32_t index, uint32_t device_count, const std::string& wanted)
+{
+    if(wanted.compare(0, 6, "index:") == 0) {
+        return is_decimal(wanted.substr(6)) && strtoull(wanted.c_str() + 6, nullptr, 10) == index;
+    }
+    if(is_decimal(wanted) && strtoull(wanted.c_str(), nullptr, 10) < device_count) {
+        return strtoull(wanted.c_str(), nullptr, 10) == index;
+    }
+
+    std::string uuid = format_uuid(c.caps.uuid);
+    uuid.erase(std::remove(uuid.begin(), uuid.end(), '-'), uuid.end());
+    std::string compact = lowercase(wanted);
+    compact.erase(std::remove(compact.begin(), compact.end(), '-'), compact.end());
+    if(compact == uuid) {
+        return true;
+    }
+
+    return lowercase(c.caps.properties.deviceName).find(lowercase(wanted)) != std::string::npos;
+}
+
+void choose_physical_device(VkInstance instance, VkPhysicalDevice* physical_device)
+{
+    uint32_t gpu_count = 0;
+    VK_CHECK(vkEnumeratePhysicalDevices(instance, &gpu_count, nullptr));
+    if(be_noisy) {
+        std::cerr << gpu_count << " gpus enumerated\n";
+    }
+    std::vector<VkPhysicalDevice> physical_devices(gpu_count);
+    VK_CHECK(vkEnumeratePhysicalDevices(instance, &gpu_count, physical_devices.data()));
+
+    std::vector<device_candidate> candidates;
+    for(auto pd : physical_devices) {
+        candidates.push_back(describe_device_candidate(pd));
+    }
+
+    if(be_noisy) {
+        for(uint32_t i = 0; i < candidates.size(); i++) {
+            const auto& c = candidates[i];
+            printf("device %u: %s (%s, %llu MB, recursion depth %u) uuid %s", i, c.caps.properties.deviceName,
+                device_types[std::min(5, (int)c.caps.properties.deviceType)], (unsigned long long)(c.device_local_bytes >> 20),
+                c.caps.ray_tracing_pipeline.maxRayRecursionDepth, format_uuid(c.caps.uuid).c_str());
+            if(c.missing.empty()) {
+                printf(" score %llx\n", (unsigned long long)c.score);
+            } else {
+                printf(" lacks %s\n", c.missing.c_str());
+            }
+        }
+    }
+
+    const device_candidate *chosen = nullptr;
+    const char *wanted = getenv("VKRT_DEVICE");
+    if(wanted) {
+        for(uint32_t i = 0; i < candidates.size() && !chosen; i++) {
+            if(device_matches(candidates[i], i, candidates.size(), wanted)) {
+                chosen = &candidates[i];
+            }
+        }
+        if(!chosen) {
+            std::cerr << "no device matches VKRT_DEVICE=" << wanted << "\n";
+            exit(EXIT_FAILURE);
+        }
+        if(!chosen->missing.empty()) {
+            std::cerr << "device " << chosen->caps.properties.deviceName << " lacks " << chosen->missing << "\n";
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        for(const auto& c : candidates) {
+            if(c.missing.empty() && (!chosen || c.score > chosen->score)) {
+                chosen = &c;
+            }
+        }
+        if(!chosen) {
+            std::cerr << "no device supports ray tracing\n";
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if(be_noisy) {
+        printf("using device %s\n", chosen->caps.properties.deviceName);
+    }
+    capabilities = chosen->caps;
+    *physical_device = chosen->caps.physical_device;
+}
+
+std::map<uint32_t, std::string> memory_property_bit_name_map = {
+    {VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, "DEVICE_LOCAL"},
+    {VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, "HOST_VISIBLE"},
+    {VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, "HOST_COHERENT"},
+    {VK_MEMORY_PROPERTY_HOST_CACHED_BIT, "HOST_CACHED"},
+    {VK_MEMORY_PROPERTY_LAZILY_ALLOCATED_BIT, "LAZILY_ALLOCATED"},
+};
+
+void print_memory_property_bits(VkMemoryPropertyFlags flags)
+{
+    bool add_or = false;
+    for(auto& bit : memory_property_bit_name_map)
+	if(flags & bit.first) {
+	    printf("%s%s", add_or ? " | " : "", bit.second.c_str());
+	    add_or = true;
+	}
+}
+
+void print_device_information(const device_capabilities& caps)
+{
+    const VkPhysicalDeviceProperties& properties = caps.properties;
+
+    printf("Physical Device Information\n");
+    printf("    API     %d.%d.%d\n", properties.apiVersion >> 22, (properties.apiVersion >> 12) & 0x3ff, properties.apiVersion & 0xfff);
+    printf("    driver  %X\n", properties.driverVersion);
+    printf("    vendor  %X\n", properties.vendorID);
+    printf("    device  %X\n", properties.deviceID);
+    printf("    name    %s\n", properties.deviceName);
+    printf("    type    %s\n", device_types[std::min(5, (int)properties.deviceType)]);
+
+    printf("    extensions:\n");
+    for(const auto& e : caps.extensions)
+	printf("        %s\n", e.extensionName);
+
+    for(size_t i = 0; i < caps.queue_families.size(); i++) {
+        const VkQueueFamilyProperties& family = caps.queue_families[i];
+        printf("queue %zd:\n", i);
+        printf("    flags:                       %04X\n", family.queueFlags);
+        printf("    queueCount:                  %d\n", family.queueCount);
+        printf("    timestampValidBits:          %d\n", family.timestampValidBits);
+        printf("    minImageTransferGranularity: (%d, %d, %d)\n",
+            family.minImageTransferGranularity.width,
+            family.minImageTransferGranularity.height,
+            family.minImageTransferGranularity.depth);
+    }
+
+    for(int i = 0; i < caps.memory.memoryTypeCount; i++) {
+        printf("memory type %d: flags ", i);
+        print_memory_property_bits(caps.memory.memoryTypes[i].propertyFlags);
+        printf("\n");
+    }
+}
+
+// Fill vkd for this device, listing everything missing before giving up
+void load_device_functions(VkDevice device)
+{
+    std::vector<std::string> missing;
+#define LOAD_DEVICE_FUNCTION(name, source) \
+    vkd.name = (PFN_vk##name)vkGetDeviceProcAddr(device, "vk" #name); \
+    if(!vkd.name) { \
+        missing.push_back(std::string("vk" #name " from ") + source); \
+    }
+    DEVICE_FUNCTIONS(LOAD_DEVICE_FUNCTION)
+#undef LOAD_DEVICE_FUNCTION
+
+    if(!missing.empty()) {
+        for(const auto& m : missing) {
+            std::cerr << "device doesn't provide " << m << "\n";
+        }
+        exit(EXIT_FAILURE);
+    }
+}
+
+void create_device(VkPhysicalDevice physical_device, VkDevice* device)
+{
+    std::vector<const char*> extensions(std::begin(required_device_extensions), std::end(required_device_extensions));
+    if(!headless) {
+        extensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+    }
+
+    // Optional: lets the geometry budget follow what the driver says this
+    // process can actually use rather than the raw heap sizes
+    if(capabilities.has_extension(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME)) {
+        extensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+        memory_budget_supported = true;
+    }
+
+    // The tonemap pass writes 8- and 10-bit output through one unformatted
+    // image declaration; the rest is what ray tracing and the pass tracker need
+    device_features enabled;
+#define ENABLE_DEVICE_FEATURE(structure, feature) \
+    enabled.structure.feature = VK_TRUE;
+    REQUIRED_DEVICE_FEATURES(ENABLE_DEVICE_FEATURE)
+#undef ENABLE_DEVICE_FEATURE
+
+    if(host_builds != HOST_BUILDS_OFF) {
+        if(capabilities.features.acceleration_structure.accelerationStructureHostCommands) {
+            enabled.acceleration_structure.accelerationStructureHostCommands = VK_TRUE;
+        } else {
+            if(be_noisy) {
+                printf("device can't build acceleration structures on the host; building every BLAS on the GPU\n");
+            }
+            host_builds = HOST_BUILDS_OFF;
+        }
+    }
+
+    VkDeviceQueueCreateInfo create_queues[1] = {};
+    float queue_priorities[1] = {1.0f};
+    create_queues[0].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+    create_queues[0].pNext = NULL;
+    create_queues[0].flags = 0;
+    create_queues[0].queueFamilyIndex = preferred_queue_family;
+    create_queues[0].queueCount = 1;
+    create_queues[0].pQueuePriorities = queue_priorities;
+
+    VkDeviceCreateInfo create = {};
+
+    create.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+    create.pNext = enabled.chain();
+    create.pEnabledFeatures = nullptr;
+    create.flags = 0;
+    create.queueCreateInfoCount = 1;
+    create.pQueueCreateInfos = create_queues;
+    create.enabledExtensionCount = extensions.size();
+    create.ppEnabledExtensionNames = extensions.data();
+    VK_CHECK(vkCreateDevice(physical_device, &create, nullptr, device));
+    load_device_functions(*device);
+
+    vkd.GetDeviceQueue(*device, preferred_queue_family, 0, &queue);
+
+    VkSemaphoreTypeCreateInfo timeline_type = { VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO, nullptr, VK_SEMAPHORE_TYPE_TIMELINE, 0 };
+    VkSemaphoreCreateInfo create_timeline = { VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO, &timeline_type, 0 };
+    VK_CHECK(vkd.CreateSemaphore(*device, &create_timeline, nullptr, &gpu_timeline));
+}
+
+// Sascha Willem's 
+uint32_t getMemoryTypeIndex(uint32_t type_bits, VkMemoryPropertyFlags properties)
+{
+    // Iterate over all memory types available for the device used in this example
+    for (uint32_t i = 0; i < memory_properties.memoryTypeCount; i++)
+	if (type_bits & (1 << i))
+	    if ((memory_properties.memoryTypes[i].propertyFlags & properties) == properties)
+		return i;
+
+    throw "Could not find a suitable memory type!";
+}
+
+// Each thread records into its own command pool, so scene uploads can be
+// recorded on the workers in parallel; submission to the one queue is
+// serialized by queue_mutex.  The pools are destroyed at cleanup.
+std::mutex command_pools_mutex;
+std::vector<VkCommandPool> command_pools;
+std::mutex queue_mutex;
+
+// Submit command buffers and return the timeline value that signals their completion
+uint64_t submit_commands(uint32_t count, const VkCommandBuffer *commands)
+{
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    uint64_t value = ++gpu_timeline_submitted;
+    VkTimelineSemaphoreSubmitInfo timeline = { VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO, nullptr };
+    timeline.signalSemaphoreValueCount = 1;
+    timeline.pSignalSemaphoreValues = &value;
+    VkSubmitInfo submit = { VK_STRUCTURE_TYPE_SUBMIT_INFO, &timeline };
+    submit.commandBufferCount = count;
+    submit.pCommandBuffers = commands;
+    submit.signalSemaphoreCount = 1;
+    submit.pSignalSemaphores = &gpu_timeline;
+    VK_CHECK(vkd.QueueSubmit(queue, 1, &submit, VK_NULL_HANDLE));
+    return value;
+}
+
+void wait_for_gpu(uint64_t value)
+{
+    VkSemaphoreWaitInfo wait = { VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO, nullptr, 0, 1, &gpu_timeline, &value };
+    VK_CHECK(vkd.WaitSemaphores(device, &wait, DEFAULT_FENCE_TIMEOUT));
+}
+
+// Submissions the GPU hasn't finished yet
+uint64_t gpu_submissions_pending()
+{
+    uint64_t completed;
+    VK_CHECK(vkd.GetSemaphoreCounterValue(device, gpu_timeline, &completed));
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    return gpu_timeline_submitted - completed;
+}
+
+VkCommandPool thread_command_pool()
+{
+    thread_local VkCommandPool pool = VK_NULL_HANDLE;
+    if(pool == VK_NULL_HANDLE) {
+        VkCommandPoolCreateInfo create_command_pool = {};
+        create_command_pool.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        create_command_pool.flags = 0;
+        create_command_pool.queueFamilyIndex = preferred_queue_family;
+        VK_CHECK(vkd.CreateCommandPool(device, &create_command_pool, nullptr, &pool));
+        std::lock_guard<std::mutex> lock(command_pools_mutex);
+        command_pools.push_back(pool);
+    }
+    return pool;
+}
+
+// Sascha Willem's 
+VkCommandBuffer getCommandBuffer(bool begin)
+{
+    VkCommandBuffer cmdBuffer;
+
+    VkCommandBufferAllocateInfo cmdBufAllocateInfo = {};
+    cmdBufAllocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    cmdBufAllocateInfo.commandPool = thread_command_pool();
+    cmdBufAllocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    cmdBufAllocateInfo.commandBufferCount = 1;
+
+    VK_CHECK(vkd.AllocateCommandBuffers(device, &cmdBufAllocateInfo, &cmdBuffer));
+
+    // If requested, also start the new command buffer
+    if (begin) {
+	VkCommandBufferBeginInfo cmdBufInfo = {};
+	cmdBufInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	cmdBufInfo.flags = 0;
+	VK_CHECK(vkd.BeginCommandBuffer(cmdBuffer, &cmdBufInfo));
+    }
+
+    return cmdBuffer;
+}
+
+// Sascha Willem's 
+void flushCommandBuffer(VkCommandBuffer commandBuffer)
+{
+    assert(commandBuffer != VK_NULL_HANDLE);
+
+    VK_CHECK(vkd.EndCommandBuffer(commandBuffer));
+
+    // Submit to the queue and wait for the command buffer to finish executing
+    wait_for_gpu(submit_commands(1, &commandBuffer));
+
+    vkd.FreeCommandBuffers(device, thread_command_pool(), 1, &commandBuffer);
+}
+
+VkDeviceSize align_up(VkDeviceSize value, VkDeviceSize alignment)
+{
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+// GPU work is recorded as passes that declare which resources they touch
+// and how.  begin_pass folds the dependencies on earlier passes (read
+// after write, write after write or read) into one vkCmdPipelineBarrier2
+// with a barrier per resource, and records nothing when there are none.
+// Barriers on the one queue order later submissions too, so the state
+// carries across command buffers.  Images stay in GENERAL layout, so
+// memory barriers cover them as well as buffers.
+enum gpu_resource {
+    RESOURCE_BLASES,
+    RESOURCE_TLAS,
+    RESOURCE_MESH_TABLE,
+    RESOURCE_TILE_ERRORS,
+    RESOURCE_WORK_LIST,
+    RESOURCE_ACCUMULATION,      // accumulation and sample count images, always used together
+    RESOURCE_OUTPUT_IMAGE,
+    RESOURCE_READBACK,          // host-visible copies of the images
+    RESOURCE_COUNT,
+};
+
+struct resource_use {
+    gpu_resource resource;
+    VkPipelineStageFlags2KHR stages;
+    VkAccessFlags2KHR access;
+    bool write;
+};
+
+struct resource_state {
+    VkPipelineStageFlags2KHR write_stages = 0;      // of the last write
+    VkAccessFlags2KHR write_access = 0;
+    VkPipelineStageFlags2KHR visible_stages = 0;    // the last write has been made visible to these
+    VkAccessFlags2KHR visible_access = 0;
+    VkPipelineStageFlags2KHR read_stages = 0;       // reads since the last write
+};
+
+resource_state resource_states[RESOURCE_COUNT];
+
+// Passes that needed a barrier and passes that didn't, since the last report
+bool print_barrier_stats = false;
+uint32_t barriers_issued = 0;
+uint32_t barriers_elided = 0;
+
+// Update the tracked state without recording a barrier, for work whose
+// dependencies were handled where it was recorded
+void record_uses(const std::vector<resource_use>& uses)
+{
+    for(const auto& use : uses) {
+        resource_state& state = resource_states[use.resource];
+        if(use.write) {
+            state.write_stages = use.stages;
+            state.write_access = use.access;
+            state.visible_stages = 0;
+            state.visible_access = 0;
+            state.read_stages = 0;
+        } else {
+            state.visible_stages |= use.stages;
+            state.visible_access |= use.access;
+            state.read_stages |= use.stages;
+        }
+    }
+}
+
+void begin_pass(VkCommandBuffer commands, const std::vector<resource_use>& uses)
+{
+    VkMemoryBarrier2KHR barriers[RESOURCE_COUNT];
+    uint32_t barrier_count = 0;
+    for(const auto& use : uses) {
+        const resource_state& state = resource_states[use.resource];
+        VkMemoryBarrier2KHR barrier = { VK_STRUCTURE_TYPE_MEMORY_BARRIER_2_KHR, nullptr };
+        bool after_write = state.write_stages != 0 &&
+            (use.write || (use.stages & ~state.visible_stages) != 0 || (use.access & ~state.visible_access) != 0);
+        if(after_write) {
+            barrier.srcStageMask |= state.write_stages;
+            barrier.srcAccessMask |= state.write_access;
+            barrier.dstStageMask |= use.stages;
+            barrier.dstAccessMask |= use.access;
+        }
+        // Overwriting only has to wait for earlier reads to execute
+        if(use.write && state.read_stages != 0) {
+            barrier.srcStageMask |= state.read_stages;
+            barrier.dstStageMask |= use.stages;
+        }
+        if(barrier.srcStageMask != 0) {
+            barriers[barrier_count++] = barrier;
+        }
+    }
+
+    if(barrier_count > 0) {
+        VkDependencyInfoKHR dependency = { VK_STRUCTURE_TYPE_DEPENDENCY_INFO_KHR, nullptr };
+        dependency.memoryBarrierCount = barrier_count;
+        dependency.pMemoryBarriers = barriers;
+        vkd.CmdPipelineBarrier2KHR(commands, &dependency);
+        barriers_issued++;
+    } else {
+        barriers_elided++;
+    }
+
+    record_uses(uses);
+}
+
+void create_buffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, buffer* b)
+{
+    VkBufferCreateInfo create_buffer = {};
+    create_buffer.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    create_buffer.pNext = nullptr;
+    create_buffer.size = size;
+    create_buffer.usage = usage;
+    create_buffer.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    VK_CHECK(vkd.CreateBuffer(device, &create_buffer, nullptr, &b->buf));
+
+    // Get the size and type requirements for memory containing this buffer
+    VkMemoryRequirements memory_req = {};
+    vkd.GetBufferMemoryRequirements(device, b->buf, &memory_req);
+
+    // Buffers handed to the GPU by address (AS inputs and storage,
+    // scratch, instances) need memory allocated with the address bit
+    VkMemoryAllocateFlagsInfo memory_flags = {};
+    memory_flags.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO;
+    memory_flags.flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT;
+
+    VkMemoryAllocateInfo memory_alloc = {};
+    memory_alloc.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    memory_alloc.pNext = (usage & VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT) ? &memory_flags : nullptr;
+    memory_alloc.allocationSize = memory_req.size;
+    memory_alloc.memoryTypeIndex = getMemoryTypeIndex(memory_req.memoryTypeBits, properties);
+    VkResult alloc_result = vkd.AllocateMemory(device, &memory_alloc, nullptr, &b->mem);
+
+    // The host-visible window into VRAM can run out; fall back to host memory
+    const VkMemoryPropertyFlags mapped_vram = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+    if(alloc_result == VK_ERROR_OUT_OF_DEVICE_MEMORY && (properties & mapped_vram) == mapped_vram) {
+        memory_alloc.memoryTypeIndex = getMemoryTypeIndex(memory_req.memoryTypeBits, properties & ~VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        alloc_result = vkd.AllocateMemory(device, &memory_alloc, nullptr, &b->mem);
+    }
+    VK_CHECK(alloc_result);
+
+    // Tell Vulkan our buffer is in this memory at offset 0
+    VK_CHECK(vkd.BindBufferMemory(device, b->buf, b->mem, 0));
+}
+
+void destroy_buffer(buffer& b)
+{
+    vkd.DestroyBuffer(device, b.buf, nullptr);
+    vkd.FreeMemory(device, b.mem, nullptr);
+    b.buf = VK_NULL_HANDLE;
+    b.mem = VK_NULL_HANDLE;
+}
+
+VkDeviceAddress get_buffer_device_address(const buffer& b)
+{
+    VkBufferDeviceAddressInfo address_info = { VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO, nullptr, b.buf };
+    return vkd.GetBufferDeviceAddress(device, &address_info);
+}
+
+// Create a GPU-local buffer and record filling it with data from a
+// host-visible staging buffer, which must live until the commands complete
+void record_device_buffer_with_data(VkCommandBuffer commands, const void* data, VkDeviceSize size, VkBufferUsageFlags usage, buffer* b, buffer* staging)
+{
+    void *mapped; // when mapped, this points to the buffer
+
+    // Find a type which is visible to the CPU and also coherent, so
+    // when we unmap it it will be immediately visible to the GPU
+    create_buffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, staging);
+
+    // Map the memory, fill it, and unmap it
+    VK_CHECK(vkd.MapMemory(device, staging->mem, 0, size, 0, &mapped));
+    memcpy(mapped, data, size);
+    vkd.UnmapMemory(device, staging->mem);
+
+    create_buffer(size, usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, b);
+
+    // Copy from staging to the GPU-local buffer
+    VkBufferCopy copy = {};
+    copy.size = size;
+    vkd.CmdCopyBuffer(commands, staging->buf, b->buf, 1, &copy);
+}
+
+// Create a GPU-local buffer and fill it with data, waiting for the copy;
+// small buffers are written in place when VRAM is host-visible
+void create_device_buffer_with_data(const void* data, VkDeviceSize size, VkBufferUsageFlags usage, buffer* b)
+{
+    if(size <= direct_write_limit) {
+        create_buffer(size, usage, direct_write_properties, b);
+        void *mapped;
+        VK_CHECK(vkd.MapMemory(device, b->mem, 0, size, 0, &mapped));
+        memcpy(mapped, data, size);
+        vkd.UnmapMemory(device, b->mem);
+        return;
+    }
+
+    buffer staging;
+    VkCommandBuffer commands = getCommandBuffer(true);
+    record_device_buffer_with_data(commands, data, size, usage, b, &staging);
+    flushCommandBuffer(commands);
+    destroy_buffer(staging);
+}
+
+void destroy_acceleration_structure(acceleration_structure& as)
+{
+    if(as.as != VK_NULL_HANDLE) {
+        vkd.DestroyAccelerationStructureKHR(device, as.as, nullptr);
+        destroy_buffer(as.storage);
+        as.as = VK_NULL_HANDLE;
+        as.address = 0;
+        as.size = 0;
+    }
+}
+
+// Create an acceleration structure over a single geometry and record its
+// build; the scratch buffer must live until the commands complete
+void record_acceleration_structure_build(VkCommandBuffer commands, VkAccelerationStructureTypeKHR type, const VkAccelerationStructureGeometryKHR& geometry, uint32_t primitive_count, acceleration_structure* as, buffer* scratch)
+{
+    VkAccelerationStructureBuildGeometryInfoKHR buildInfo { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR, nullptr };
+
+    buildInfo.type = type;
+    buildInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+    buildInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+    buildInfo.srcAccelerationStructure = VK_NULL_HANDLE;
+    buildInfo.dstAccelerationStructure = VK_NULL_HANDLE;
+    buildInfo.geometryCount = 1;
+    buildInfo.pGeometries = &geometry;
+    buildInfo.ppGeometries = nullptr;
+    buildInfo.scratchData.deviceAddress = 0;
+
+    VkAccelerationStructureBuildSizesInfoKHR sizeInfo { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR, nullptr };
+    vkd.GetAccelerationStructureBuildSizesKHR(device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &buildInfo, &primitive_count, &sizeInfo);
+
+    if(be_noisy) {
+        std::cout << (type == VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR ? "TLAS" : "BLAS") << " over " << primitive_count << " primitives:\n";
+        std::cout << "    sizeInfo.accelerationStructureSize = " << sizeInfo.accelerationStructureSize << "\n";
+        std::cout << "    sizeInfo.buildScratchSize = " << sizeInfo.buildScratchSize << "\n";
+    }
+
+    create_buffer(sizeInfo.accelerationStructureSize, VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &as->storage);
+
+    VkAccelerationStructureCreateInfoKHR create = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR, nullptr };
+    create.buffer = as->storage.buf;
+    create.offset = 0;
+    create.size = sizeInfo.accelerationStructureSize;
+    create.type = type;
+    VK_CHECK(vkd.CreateAccelerationStructureKHR(device, &create, nullptr, &as->as));
+    as->size = sizeInfo.accelerationStructureSize;
+
+    // Create Scratch Buffer, with room to align the start to what the implementation wants
+    VkDeviceSize scratch_alignment = std::max(1u, acceleration_structure_properties.minAccelerationStructureScratchOffsetAlignment);
+    create_buffer(sizeInfo.buildScratchSize + scratch_alignment, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, scratch);
+
+    buildInfo.dstAccelerationStructure = as->as;
+    buildInfo.scratchData.deviceAddress = align_up(get_buffer_device_address(*scratch), scratch_alignment);
+
+    VkAccelerationStructureBuildRangeInfoKHR range = {};
+    range.primitiveCount = primitive_count;
+    const VkAccelerationStructureBuildRangeInfoKHR* ranges[] = { &range };
+
+    vkd.CmdBuildAccelerationStructuresKHR(commands, 1, &buildInfo, ranges);
+
+    VkAccelerationStructureDeviceAddressInfoKHR address_info = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR, nullptr, as->as };
+    as->address = vkd.GetAccelerationStructureDeviceAddressKHR(device, &address_info);
+}
+
+// Device-local bytes this process may use: what VK_EXT_memory_budget says
+// is left (counting our own geometry as reclaimable), or else the
+// device-local heap sizes, of which only half is assumed to be ours
+VkDeviceSize device_local_budget()
+{
+    VkPhysicalDeviceMemoryBudgetPropertiesEXT budget = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT, nullptr };
+    VkPhysicalDeviceMemoryProperties2 properties2 = { VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2, memory_budget_supported ? &budget : nullptr };
+    vkGetPhysicalDeviceMemoryProperties2(physical_device, &properties2);
+
+    VkDeviceSize total = 0;
+    for(uint32_t i = 0; i < properties2.memoryProperties.memoryHeapCount; i++) {
+        const VkMemoryHeap& heap = properties2.memoryProperties.memoryHeaps[i];
+        if(heap.flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) {
+            if(memory_budget_supported) {
+                total += budget.heapBudget[i] - std::min(budget.heapBudget[i], budget.heapUsage[i]);
+            } else {
+                total += heap.size / 2;
+            }
+        }
+    }
+    if(memory_budget_supported) {
+        total += geometry_resident_bytes;
+    }
+    return total;
+}
+
+VkDeviceSize current_geometry_budget()
+{
+    if(geometry_budget != 0) {
+        return geometry_budget;
+    }
+    // Leave room for the render targets, TLAS and build scratch
+    return device_local_budget() / 10 * 8;
+}
+
+void record_mesh_blas_build(VkCommandBuffer commands, mesh& m, buffer* scratch)
+{
+    VkAccelerationStructureGeometryTrianglesDataKHR triangles = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR, nullptr};
+    triangles.vertexFormat = VK_FORMAT_R32G32B32_SFLOAT;
+    triangles.vertexData.deviceAddress = get_buffer_device_address(m.vertex_buffer);
+    triangles.vertexStride = sizeof(Vertex);
+    triangles.maxVertex = m.vertex_count - 1;
+    triangles.indexType = VK_INDEX_TYPE_UINT32;
+    triangles.indexData.deviceAddress = get_buffer_device_address(m.index_buffer);
+    triangles.transformData.hostAddress = 0;
+
+    VkAccelerationStructureGeometryKHR geometry = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR, nullptr };
+    geometry.geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR;
+    geometry.geometry.triangles = triangles;
+    geometry.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
+
+    record_acceleration_structure_build(commands, VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR, geometry, m.triangle_count, &m.blas, scratch);
+}
+
+// Create a BLAS and record restoring it from serialized data; false if
+// this driver can't take it (the data came from a different device or
+// driver version).  The staging buffer must live until the commands complete.
+bool record_blas_deserialize(VkCommandBuffer commands, mesh& m, buffer* staging)
+{
+    // Header: driver UUID, compatibility UUID, serialized size, deserialized
+    // size, instance handle count
+    const size_t header_size = 2 * VK_UUID_SIZE + 3 * sizeof(uint64_t);
+    if(m.serialized_blas.size() < header_size) {
+        return false;
+    }
+    VkAccelerationStructureVersionInfoKHR version = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_VERSION_INFO_KHR, nullptr, m.serialized_blas.data() };
+    VkAccelerationStructureCompatibilityKHR compatibility;
+    vkd.GetDeviceAccelerationStructureCompatibilityKHR(device, &version, &compatibility);
+    if(compatibility != VK_ACCELERATION_STRUCTURE_COMPATIBILITY_COMPATIBLE_KHR) {
+        return false;
+    }
+    uint64_t as_size;
+    memcpy(&as_size, m.serialized_blas.data() + 2 * VK_UUID_SIZE + sizeof(uint64_t), sizeof(as_size));
+
+    create_buffer(as_size, VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &m.blas.storage);
+    VkAccelerationStructureCreateInfoKHR create = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR, nullptr };
+    create.buffer = m.blas.storage.buf;
+    create.size = as_size;
+    create.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+    VK_CHECK(vkd.CreateAccelerationStructureKHR(device, &create, nullptr, &m.blas.as));
+    m.blas.size = as_size;
+
+    void *mapped;
+    create_buffer(m.serialized_blas.size() + 256, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, staging);
+    VkDeviceAddress base = get_buffer_device_address(*staging);
+    VkDeviceAddress aligned = align_up(base, 256);
+    VK_CHECK(vkd.MapMemory(device, staging->mem, 0, VK_WHOLE_SIZE, 0, &mapped));
+    memcpy(static_cast<uint8_t*>(mapped) + (aligned - base), m.serialized_blas.data(), m.serialized_blas.size());
+    vkd.UnmapMemory(device, staging->mem);
+
+    VkCopyMemoryToAccelerationStructureInfoKHR copy = { VK_STRUCTURE_TYPE_COPY_MEMORY_TO_ACCELERATION_STRUCTURE_INFO_KHR, nullptr };
+    copy.src.deviceAddress = aligned;
+    copy.dst = m.blas.as;
+    copy.mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_DESERIALIZE_KHR;
+    vkd.CmdCopyMemoryToAccelerationStructureKHR(commands, &copy);
+
+    VkAccelerationStructureDeviceAddressInfoKHR address_info = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR, nullptr, m.blas.as };
+    m.blas.address = vkd.GetAccelerationStructureDeviceAddressKHR(device, &address_info);
+    return true;
+}
+
+// One mesh's upload and BLAS build or restore, recorded on whichever
+// thread picks it up into a command buffer from that thread's pool; the
+// staging and scratch buffers are freed once the batch has executed
+struct mesh_upload {
+    mesh *m;
+    VkCommandPool pool;
+    VkCommandBuffer commands;
+    buffer temporaries[3];
+    int temporary_count = 0;
+    bool restored = false;
+    bool host_build = false;    // the BLAS is built on the CPU after submitting the copies
+    VkQueryPool sizes = VK_NULL_HANDLE;
+    uint32_t query = 0;         // slot in sizes for the BLAS's serialized size
+};
+
+void record_mesh_upload(mesh_upload& upload)
+{
+    mesh& m = *upload.m;
+    assert(!m.host_vertices.empty() && !m.host_indices.empty());
+    upload.pool = thread_command_pool();
+    upload.commands = getCommandBuffer(true);
+
+    VkBufferUsageFlags usage = VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+    record_device_buffer_with_data(upload.commands, m.host_vertices.data(), sizeof(Vertex) * m.host_vertices.size(), usage | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, &m.vertex_buffer, &upload.temporaries[upload.temporary_count++]);
+    record_device_buffer_with_data(upload.commands, m.host_indices.data(), sizeof(uint32_t) * m.host_indices.size(), usage | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, &m.index_buffer, &upload.temporaries[upload.temporary_count++]);
+
+    // The BLAS build reads the geometry the copies just wrote
+    VkMemoryBarrier uploaded = { VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT };
+    vkd.CmdPipelineBarrier(upload.commands, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &uploaded, 0, nullptr, 0, nullptr);
+
+    if(!upload.host_build) {
+        upload.restored = !m.serialized_blas.empty() && record_blas_deserialize(upload.commands, m, &upload.temporaries[upload.temporary_count]);
+        if(!upload.restored) {
+            record_mesh_blas_build(upload.commands, m, &upload.temporaries[upload.temporary_count]);
+        }
+        upload.temporary_count++;
+
+        // Size the BLAS for serializing now, so evicting it later takes one submit
+        VkMemoryBarrier built = { VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR, VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR };
+        vkd.CmdPipelineBarrier(upload.commands, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &built, 0, nullptr, 0, nullptr);
+        vkd.CmdResetQueryPool(upload.commands, upload.sizes, upload.query, 1);
+        vkd.CmdWriteAccelerationStructuresPropertiesKHR(upload.commands, 1, &m.blas.as, VK_QUERY_TYPE_ACCELERATION_STRUCTURE_SERIALIZATION_SIZE_KHR, upload.sizes, upload.query);
+    }
+
+    VK_CHECK(vkd.EndCommandBuffer(upload.commands));
+}
+
+// Whether this mesh's BLAS should be built on the CPU
+bool build_on_host(const mesh& m, uint64_t pending)
+{
+    switch(host_builds) {
+        case HOST_BUILDS_ALL: return true;
+        case HOST_BUILDS_AUTO: return m.triangle_count <= host_build_max_triangles && pending > 0 && direct_write_limit > 0;
+        default: return false;
+    }
+}
+
+// Build a mesh's BLAS on the CPU from its host copy, spreading the
+// deferred operation over the workers and the calling thread
+void host_build_blas(mesh& m)
+{
+    VkAccelerationStructureGeometryTrianglesDataKHR triangles = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR, nullptr};
+    triangles.vertexFormat = VK_FORMAT_R32G32B32_SFLOAT;
+    triangles.vertexData.hostAddress = m.host_vertices.data();
+    triangles.vertexStride = sizeof(Vertex);
+    triangles.maxVertex = m.vertex_count - 1;
+    triangles.indexType = VK_INDEX_TYPE_UINT32;
+    triangles.indexData.hostAddress = m.host_indices.data();
+    triangles.transformData.hostAddress = nullptr;
+
+    VkAccelerationStructureGeometryKHR geometry = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR, nullptr };
+    geometry.geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR;
+    geometry.geometry.triangles = triangles;
+    geometry.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
+
+    VkAccelerationStructureBuildGeometryInfoKHR build = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR, nullptr };
+    build.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+    build.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+    build.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+    build.geometryCount = 1;
+    build.pGeometries = &geometry;
+
+    VkAccelerationStructureBuildSizesInfoKHR sizes = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR, nullptr };
+    vkd.GetAccelerationStructureBuildSizesKHR(device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_HOST_KHR, &build, &m.triangle_count, &sizes);
+
+    // Host commands need the storage mapped, so it goes in direct-write memory
+    create_buffer(sizes.accelerationStructureSize, VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, direct_write_properties, &m.blas.storage);
+    VkAccelerationStructureCreateInfoKHR create = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR, nullptr };
+    create.buffer = m.blas.storage.buf;
+    create.size = sizes.accelerationStructureSize;
+    create.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+    VK_CHECK(vkd.CreateAccelerationStructureKHR(device, &create, nullptr, &m.blas.as));
+    m.blas.size = sizes.accelerationStructureSize;
+
+    std::vector<uint8_t> scratch(sizes.buildScratchSize + 16);
+    build.dstAccelerationStructure = m.blas.as;
+    build.scratchData.hostAddress = scratch.data() + ((16 - (uintptr_t)scratch.data() % 16) % 16);
+
+    VkAccelerationStructureBuildRangeInfoKHR range = {};
+    range.primitiveCount = m.triangle_count;
+    const VkAccelerationStructureBuildRangeInfoKHR* ranges[] = { &range };
+
+    VkDeferredOperationKHR operation;
+    VK_CHECK(vkd.CreateDeferredOperationKHR(device, nullptr, &operation));
+    VkResult build_result = vkd.BuildAccelerationStructuresKHR(device, operation, 1, &build, ranges);
+    if(build_result == VK_OPERATION_DEFERRED_KHR) {
+        uint32_t concurrency = vkd.GetDeferredOperationMaxConcurrencyKHR(device, operation);
+        parallel_for(std::max(1u, std::min(concurrency, workers->size() + 1)), [&](size_t) {
+            while(vkd.DeferredOperationJoinKHR(device, operation) == VK_THREAD_IDLE_KHR) {
+                std::this_thread::yield();
+            }
+        });
+        build_result = vkd.GetDeferredOperationResultKHR(device, operation);
+    } else if(build_result == VK_OPERATION_NOT_DEFERRED_KHR) {
+        build_result = VK_SUCCESS;
+    }
+    vkd.DestroyDeferredOperationKHR(device, operation, nullptr);
+    VK_CHECK(build_result);
+
+    VkAccelerationStructureDeviceAddressInfoKHR address_info = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR, nullptr, m.blas.as };
+    m.blas.address = vkd.GetAccelerationStructureDeviceAddressKHR(device, &address_info);
+
+    size_t serialized_size;
+    VK_CHECK(vkd.WriteAccelerationStructuresPropertiesKHR(device, 1, &m.blas.as, VK_QUERY_TYPE_ACCELERATION_STRUCTURE_SERIALIZATION_SIZE_KHR, sizeof(serialized_size), &serialized_size, sizeof(serialized_size)));
+    m.serialized_size = serialized_size;
+}
+
+// Mesh uploads submitted together.  Host-side BLAS builds run on the
+// workers meanwhile, so nothing here blocks until the batch is finished.
+struct upload_batch {
+    std::vector<mesh_upload> uploads;
+    VkQueryPool sizes = VK_NULL_HANDLE;     // serialized sizes of the GPU-built BLASes
+    uint64_t submitted = 0;     // timeline value of the copies and GPU builds
+    std::atomic<uint32_t> host_builds_left{0};
+};
+
+// Mark meshes most recently used, so the geometry budget keeps them
+void touch_meshes(const std::vector<uint32_t>& indices)
+{
+    for(uint32_t index : indices) {
+        meshes[index].last_used = ++residency_clock;
+    }
+}
+
+// Record and submit uploads of the meshes that aren't resident or already
+// on their way, and mark all of them most recently used.  Recording is
+// spread over the workers and this thread; everything is submitted together.
+std::shared_ptr<upload_batch> start_uploads(const std::vector<uint32_t>& indices)
+{
+    auto batch = std::make_shared<upload_batch>();
+    std::vector<mesh_upload>& uploads = batch->uploads;
+    touch_meshes(indices);
+    for(uint32_t index : indices) {
+        mesh& m = meshes[index];
+        if(!m.resident && !m.uploading) {
+            mesh_upload upload;
+            upload.m = &m;
+            uploads.push_back(upload);
+            m.uploading = batch.get();
+        }
+    }
+    if(uploads.empty()) {
+        return batch;
+    }
+
+    // A BLAS with serialized data is restored on the GPU, which is cheaper than any build
+    uint64_t pending = (host_builds == HOST_BUILDS_OFF) ? 0 : gpu_submissions_pending();
+    uint32_t gpu_builds = 0;
+    for(auto& upload : uploads) {
+        upload.host_build = upload.m->serialized_blas.empty() && build_on_host(*upload.m, pending);
+        batch->host_builds_left += upload.host_build ? 1 : 0;
+        if(!upload.host_build) {
+            upload.query = gpu_builds++;
+        }
+    }
+    if(gpu_builds > 0) {
+        VkQueryPoolCreateInfo create_pool = { VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO, nullptr };
+        create_pool.queryType = VK_QUERY_TYPE_ACCELERATION_STRUCTURE_SERIALIZATION_SIZE_KHR;
+        create_pool.queryCount = gpu_builds;
+        VK_CHECK(vkd.CreateQueryPool(device, &create_pool, nullptr, &batch->sizes));
+        for(auto& upload : uploads) {
+            upload.sizes = batch->sizes;
+        }
+    }
+
+    parallel_for(uploads.size(), [&](size_t i) { record_mesh_upload(uploads[i]); });
+
+    std::vector<VkCommandBuffer> commands;
+    for(const auto& upload : uploads) {
+        commands.push_back(upload.commands);
+    }
+    batch->submitted = submit_commands(commands.size(), commands.data());
+
+    // The CPU builds while the GPU copies and builds the rest
+    for(auto& upload : uploads) {
+        if(upload.host_build) {
+            mesh *m = upload.m;
+            workers->submit([batch, m]() {
+                host_build_blas(*m);
+                batch->host_builds_left--;
+            });
+        }
+    }
+    return batch;
+}
+
+bool uploads_finished(const upload_batch& batch)
+{
+    uint64_t completed;
+    VK_CHECK(vkd.GetSemaphoreCounterValue(device, gpu_timeline, &completed));
+    return completed >= batch.submitted && batch.host_builds_left == 0;
+}
+
+// Release a finished batch's temporaries and mark its meshes resident
+void finish_uploads(upload_batch& batch)
+{
+    if(batch.uploads.empty()) {
+        return;
+    }
+    record_uses({{ RESOURCE_BLASES, VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_ACCESS_2_ACCELERATION_STRUCTURE_WRITE_BIT_KHR, true }});
+
+    // Workers only record inside start_uploads, so their pools can be touched from here
+    size_t host_built = 0;
+    for(auto& upload : batch.uploads) {
+        vkd.FreeCommandBuffers(device, upload.pool, 1, &upload.commands);
+        for(int i = 0; i < upload.temporary_count; i++) {
+            destroy_buffer(upload.temporaries[i]);
+        }
+        mesh& m = *upload.m;
+        if(upload.restored && be_noisy) {
+            std::cout << "restored BLAS from " << m.serialized_blas.size() << " serialized bytes\n";
+        }
+        host_built += upload.host_build ? 1 : 0;
+        if(!upload.host_build) {
+            uint64_t serialized_size;
+            VK_CHECK(vkd.GetQueryPoolResults(device, batch.sizes, upload.query, 1, sizeof(serialized_size), &serialized_size, sizeof(serialized_size), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+            m.serialized_size = serialized_size;
+        }
+        m.device_bytes = sizeof(Vertex) * m.host_vertices.size() + sizeof(uint32_t) * m.host_indices.size() + m.blas.size;
+        geometry_resident_bytes += m.device_bytes;
+        m.resident = true;
+        m.uploading = nullptr;
+    }
+    if(be_noisy) {
+        std::cout << "uploaded " << batch.uploads.size() << " meshes in one submit, " << host_built << " BLASes built on the host\n";
+    }
+    if(batch.sizes != VK_NULL_HANDLE) {
+        vkd.DestroyQueryPool(device, batch.sizes, nullptr);
+        batch.sizes = VK_NULL_HANDLE;
+    }
+    batch.uploads.clear();
+}
+
+void wait_for_uploads(upload_batch& batch)
+{
+    wait_for_gpu(batch.submitted);
+    while(batch.host_builds_left > 0) {
+        std::this_thread::yield();
+    }
+    finish_uploads(batch);
+}
+
+// Upload the meshes that aren't resident and restore or build their
+// BLASes, and mark all of them most recently used.  Meshes another batch
+// is already bringing back are waited for; that batch's owner finds it
+// finished.
+void make_resident(const std::vector<uint32_t>& indices)
+{
+    auto batch = start_uploads(indices);
+    for(uint32_t index : indices) {
+        if(meshes[index].uploading && meshes[index].uploading != batch.get()) {
+            wait_for_uploads(*meshes[index].uploading);
+        }
+    }
+    wait_for_uploads(*batch);
+}
+
+void release_mesh(mesh& m)
+{
+    if(!m.resident) {
+        return;
+    }
+    destroy_acceleration_structure(m.blas);
+    destroy_buffer(m.vertex_buffer);
+    destroy_buffer(m.index_buffer);
+    geometry_resident_bytes -= m.device_bytes;
+    m.device_bytes = 0;
+    m.resident = false;
+}
+
+// Copy built BLASes into host memory in the driver's serialized form,
+// which can be copied back without another build.  All of them go in one
+// submit; their sizes were queried when they were built.
+void serialize_blases(const std::vector<mesh*>& victims)
+{
+    if(victims.empty()) {
+        return;
+    }
+    // Serialized data must start 256-byte aligned
+    std::vector<VkDeviceSize> offsets;
+    VkDeviceSize total = 0;
+    for(mesh *m : victims) {
+        offsets.push_back(total);
+        total += align_up(m->serialized_size, 256);
+    }
+    buffer staging;
+    create_buffer(total + 256, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &staging);
+    VkDeviceAddress base = get_buffer_device_address(staging);
+    VkDeviceAddress aligned = align_up(base, 256);
+
+    VkCommandBuffer commands = getCommandBuffer(true);
+    begin_pass(commands, {{ RESOURCE_BLASES, VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_ACCESS_2_ACCELERATION_STRUCTURE_READ_BIT_KHR, false }});
+    for(size_t i = 0; i < victims.size(); i++) {
+        VkCopyAccelerationStructureToMemoryInfoKHR copy = { VK_STRUCTURE_TYPE_COPY_ACCELERATION_STRUCTURE_TO_MEMORY_INFO_KHR, nullptr };
+        copy.src = victims[i]->blas.as;
+        copy.dst.deviceAddress = aligned + offsets[i];
+        copy.mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_SERIALIZE_KHR;
+        vkd.CmdCopyAccelerationStructureToMemoryKHR(commands, &copy);
+    }
+    VkMemoryBarrier copied = { VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_HOST_READ_BIT };
+    vkd.CmdPipelineBarrier(commands, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &copied, 0, nullptr, 0, nullptr);
+    flushCommandBuffer(commands);
+
+    void *mapped;
+    VK_CHECK(vkd.MapMemory(device, staging.mem, 0, VK_WHOLE_SIZE, 0, &mapped));
+    for(size_t i = 0; i < victims.size(); i++) {
+        const uint8_t *src = static_cast<const uint8_t*>(mapped) + (aligned - base) + offsets[i];
+        victims[i]->serialized_blas.assign(src, src + victims[i]->serialized_size);
+        serialized_blas_bytes += victims[i]->serialized_size;
+    }
+    vkd.UnmapMemory(device, staging.mem);
+    destroy_buffer(staging);
+}
+
+void drop_serialized_blas(mesh& m)
+{
+    serialized_blas_bytes -= m.serialized_blas.size();
+    m.serialized_blas = std::vector<uint8_t>();
+}
+
+// Drop the least recently used serialized BLASes until they fit their
+// budget; those meshes are rebuilt when they come back
+void trim_serialized_blases()
+{
+    while(serialized_blas_bytes > serialized_blas_budget) {
+        mesh *oldest = nullptr;
+        for(auto& m : meshes) {
+            if(!m.serialized_blas.empty() && (!oldest || m.last_used < oldest->last_used)) {
+                oldest = &m;
+            }
+        }
+        if(!oldest) {
+            return;
+        }
+        drop_serialized_blas(*oldest);
+    }
+}
+
+void mark_in_scene(uint32_t index)
+{
+    meshes[index].in_scene = true;
+    for(uint32_t lod : meshes[index].lods) {
+        meshes[lod].in_scene = true;
+    }
+}
+
+// Free the host copies and serialized BLASes of cached meshes that the
+// current scene doesn't use and that aren't resident, along with their
+// LODs.  Their slots stay (indices are baked into instance records) but
+// they leave the cache, so a scene that wants them loads them again.
+void forget_unused_meshes()
+{
+    for(auto it = mesh_cache.begin(); it != mesh_cache.end(); ) {
+        std::vector<uint32_t> family = meshes[it->second].lods;
+        family.push_back(it->second);
+        bool unused = true;
+        for(uint32_t index : family) {
+            unused = unused && !meshes[index].in_scene && !meshes[index].resident && !meshes[index].uploading;
+        }
+        if(!unused) {
+            ++it;
+            continue;
+        }
+        for(uint32_t index : family) {
+            mesh& m = meshes[index];
+            drop_serialized_blas(m);
+            m.host_vertices = std::vector<Vertex>();
+            m.host_indices = std::vector<uint32_t>();
+        }
+        if(be_noisy) {
+            std::cout << "forgetting mesh " << it->second << " (" << it->first << ")\n";
+        }
+        it = mesh_cache.erase(it);
+    }
+}
+
+// Evict least-recently-used meshes until the resident geometry fits the
+// budget; meshes used since in_use_since are needed by the current scene
+// and are never evicted, even if that leaves the budget exceeded.
+// Victims the current scene still references are serialized, all in one
+// submit; the rest are forgotten.
+void enforce_geometry_budget(uint64_t in_use_since)
+{
+    VkDeviceSize budget = current_geometry_budget();
+    if(geometry_resident_bytes <= budget) {
+        return;
+    }
+    std::vector<uint32_t> candidates;
+    for(size_t i = 0; i < meshes.size(); i++) {
+        if(meshes[i].resident && meshes[i].last_used <= in_use_since) {
+            candidates.push_back(i);
+        }
+    }
+    std::sort(candidates.begin(), candidates.end(), [](uint32_t a, uint32_t b) { return meshes[a].last_used < meshes[b].last_used; });
+
+    std::vector<uint32_t> victims;
+    VkDeviceSize remaining = geometry_resident_bytes;
+    for(uint32_t index : candidates) {
+        if(remaining <= budget) {
+            break;
+        }
+        victims.push_back(index);
+        remaining -= meshes[index].device_bytes;
+    }
+    if(remaining > budget && be_noisy) {
+        std::cout << "scene geometry (" << remaining << " bytes) exceeds budget of " << budget << " bytes\n";
+    }
+
+    std::vector<mesh*> to_serialize;
+    for(uint32_t index : victims) {
+        mesh& m = meshes[index];
+        if(m.in_scene && m.serialized_blas.empty() && m.serialized_size > 0) {
+            to_serialize.push_back(&m);
+        }
+    }
+    serialize_blases(to_serialize);
+
+    for(uint32_t index : victims) {
+        if(be_noisy) {
+            std::cout << "evicting mesh " << index << " (" << meshes[index].device_bytes << " bytes)\n";
+        }
+        release_mesh(meshes[index]);
+    }
+    forget_unused_meshes();
+    trim_serialized_blases();
+}
+
+// Keep a host copy of mesh geometry; it is uploaded and its BLAS built
+// when a scene first places it.  Returns the index of the mesh.
+uint32_t create_mesh(const Vertex* vertices, uint32_t vertex_count, const uint32_t *indices, uint32_t index_count)
+{
+    mesh m;
+    m.vertex_count = vertex_count;
+    m.triangle_count = index_count / 3;
+    m.radius = 0.0f;
+    for(int i = 0; i < 3; i++) {
+        m.bounds_min[i] = vertices[0].v[i];
+        m.bounds_max[i] = vertices[0].v[i];
+    }
+    for(uint32_t j = 0; j < vertex_count; j++) {
+        const float *v = vertices[j].v;
+        for(int i = 0; i < 3; i++) {
+            m.bounds_min[i] = std::min(m.bounds_min[i], v[i]);
+            m.bounds_max[i] = std::max(m.bounds_max[i], v[i]);
+        }
+        m.radius = std::max(m.radius, sqrtf(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]));
+    }
+    m.host_vertices.assign(vertices, vertices + vertex_count);
+    m.host_indices.assign(indices, indices + index_count);
+
+    meshes.push_back(m);
+    return meshes.size() - 1;
+}
+
+// Place a mesh in the scene.  transform is row-major 3x4 object-to-world
+// and sbt_offset (24 bits wide) selects the hit group record.  Shaders
+// find the geometry through gl_InstanceCustomIndexEXT, which build_tlas
+// sets to the mesh table index of the chosen LOD.
+void add_instance(uint32_t mesh_index, const float transform[3][4], uint8_t mask, uint32_t sbt_offset, VkGeometryInstanceFlagsKHR flags)
+{
+    assert(mesh_index < (1u << 24));
+    assert(sbt_offset < (1u << 24));
+
+    VkAccelerationStructureInstanceKHR inst = {};
+    memcpy(inst.transform.matrix, transform, sizeof(inst.transform.matrix));
+    inst.instanceCustomIndex = mesh_index;
+    inst.mask = mask;
+    inst.instanceShaderBindingTableRecordOffset = sbt_offset;
+    inst.flags = flags;
+    instances.push_back(inst);
+    instance_meshes.push_back(mesh_index);
+    instance_lods.push_back(LOD_UNCHOSEN);
+}
+
+// Coarser versions of a mesh by vertex clustering: vertices are merged
+// per grid cell, averaging positions and colors, and triangles that
+// collapse are dropped.  Each try halves the grid; a level is kept only
+// if it at least halves the triangles of the one before.
+std::vector<uint32_t> create_lods(const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices)
+{
+    std::vector<uint32_t> lods;
+    float lo[3], hi[3];
+    for(int i = 0; i < 3; i++) {
+        lo[i] = hi[i] = vertices[0].v[i];
+    }
+    for(const auto& vertex : vertices) {
+        for(int i = 0; i < 3; i++) {
+            lo[i] = std::min(lo[i], vertex.v[i]);
+            hi[i] = std::max(hi[i], vertex.v[i]);
+        }
+    }
+    float extent = std::max(hi[0] - lo[0], std::max(hi[1] - lo[1], hi[2] - lo[2]));
+    if(extent <= 0.0f) {
+        return lods;
+    }
+
+    size_t triangles = indices.size() / 3;
+    for(int cells = 64; cells >= 4 && lods.size() < max_lod_levels; cells /= 2) {
+        float cell = extent / cells;
+        std::map<std::tuple<int, int, int>, uint32_t> clusters;
+        std::vector<Vertex> merged;
+        std::vector<uint32_t> counts;
+        std::vector<uint32_t> remap(vertices.size());
+        for(size_t j = 0; j < vertices.size(); j++) {
+            const Vertex& vertex = vertices[j];
+            auto key = std::make_tuple((int)((vertex.v[0] - lo[0]) / cell), (int)((vertex.v[1] - lo[1]) / cell), (int)((vertex.v[2] - lo[2]) / cell));
+            auto found = clusters.find(key);
+            if(found == clusters.end()) {
+                found = clusters.insert({key, (uint32_t)merged.size()}).first;
+                merged.push_back({{0, 0, 0}, {0, 0, 0}});
+                counts.push_back(0);
+            }
+            Vertex& sum = merged[found->second];
+            for(int i = 0; i < 3; i++) {
+                sum.v[i] += vertex.v[i];
+                sum.c[i] += vertex.c[i];
+            }
+            counts[found->second]++;
+            remap[j] = found->second;
+        }
+        for(size_t j = 0; j < merged.size(); j++) {
+            for(int i = 0; i < 3; i++) {
+                merged[j].v[i] /= counts[j];
+                merged[j].c[i] /= counts[j];
+            }
+        }
+
+        std::vector<uint32_t> coarse;
+        for(size_t t = 0; t + 2 < indices.size(); t += 3) {
+            uint32_t a = remap[indices[t]], b = remap[indices[t + 1]], c = remap[indices[t + 2]];
+            if(a != b && b != c && a != c) {
+                coarse.insert(coarse.end(), {a, b, c});
+            }
+        }
+        if(coarse.empty() || coarse.size() / 3 > triangles / 2) {
+            continue;
+        }
+        lods.push_back(create_mesh(merged.data(), merged.size(), coarse.data(), coarse.size()));
+        triangles = coarse.size() / 3;
+    }
+    return lods;
+}
+
+// Imported meshes get their LODs generated along with them
+uint32_t create_mesh_with_lods(const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices)
+{
+    uint32_t index = create_mesh(vertices.data(), vertices.size(), indices.data(), indices.size());
+    std::vector<uint32_t> lods = create_lods(vertices, indices);
+    meshes[index].lods = lods;
+    return index;
+}
+
+uint32_t lod_for_size(float pixels, uint32_t levels)
+{
+    if(pixels >= lod_pixels) {
+        return 0;
+    }
+    uint32_t level = 1 + (uint32_t)log2f(lod_pixels / std::max(pixels, 1e-6f));
+    return std::min(level, levels - 1);
+}
+
+// The LOD of a mesh placed with this transform, from the size of its
+// bounding sphere on screen
+uint32_t choose_lod(uint32_t mesh_index, const float transform[3][4], uint32_t previous)
+{
+    const mesh& m = meshes[mesh_index];
+    float half_height = sqrtf(camera.up[0] * camera.up[0] + camera.up[1] * camera.up[1] + camera.up[2] * camera.up[2]);
+    uint32_t levels = 1 + m.lods.size();
+    if(levels == 1 || half_height <= 0.0f) {
+        return 0;
+    }
+    float scale = 0.0f;
+    for(int column = 0; column < 3; column++) {
+        scale = std::max(scale, sqrtf(transform[0][column] * transform[0][column] + transform[1][column] * transform[1][column] + transform[2][column] * transform[2][column]));
+    }
+    float d[3] = { transform[0][3] - camera.position[0], transform[1][3] - camera.position[1], transform[2][3] - camera.position[2] };
+    float distance = sqrtf(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+    float radius = m.radius * scale;
+    float pixels = (distance > radius) ? (radius / distance) / half_height * frame_height : lod_pixels;
+
+    if(previous != LOD_UNCHOSEN && previous >= lod_for_size(pixels * 1.25f, levels) && previous <= lod_for_size(pixels / 1.25f, levels)) {
+        return previous;
+    }
+    return lod_for_size(pixels, levels);
+}
+
+// Choose each instance's LOD; returns whether any instance changed level
+bool select_lods()
+{
+    bool changed = false;
+    for(size_t i = 0; i < instances.size(); i++) {
+        uint32_t level = choose_lod(instance_meshes[i], instances[i].transform.matrix, instance_lods[i]);
+        changed = changed || (level != instance_lods[i]);
+        instance_lods[i] = level;
+    }
+    return changed;
+}
+
+// The mesh a level of detail of a mesh refers to
+uint32_t lod_mesh(uint32_t mesh_index, uint32_t level)
+{
+    return (level == 0 || level == LOD_UNCHOSEN) ? mesh_index : meshes[mesh_index].lods[level - 1];
+}
+
+// The mesh each instance's chosen LOD refers to
+std::vector<uint32_t> lod_instance_meshes()
+{
+    std::vector<uint32_t> lod_meshes(instances.size());
+    for(size_t i = 0; i < instances.size(); i++) {
+        lod_meshes[i] = lod_mesh(instance_meshes[i], instance_lods[i]);
+    }
+    return lod_meshes;
+}
+
+// Copy the instance records into the instance buffer and record
+// (re)building the TLAS over them; every placed mesh's chosen LOD must be
+// resident, and the scratch buffer must live until the commands complete
+void record_tlas_build(VkCommandBuffer commands, buffer* scratch)
+{
+    std::vector<uint32_t> lod_meshes = lod_instance_meshes();
+    for(size_t i = 0; i < instances.size(); i++) {
+        assert(meshes[lod_meshes[i]].resident);
+        instances[i].accelerationStructureReference = meshes[lod_meshes[i]].blas.address;
+        instances[i].instanceCustomIndex = lod_meshes[i];
+    }
+
+    size_t needed = std::max((size_t)1, instances.size());
+    if(needed > instance_buffer_capacity) {
+        if(instance_buffer_mapped) {
+            vkd.UnmapMemory(device, instance_buffer.mem);
+            destroy_buffer(instance_buffer);
+        }
+        // Grow geometrically so adding placements one batch at a time stays cheap
+        instance_buffer_capacity = std::max(needed, instance_buffer_capacity * 2);
+        create_buffer(sizeof(VkAccelerationStructureInstanceKHR) * instance_buffer_capacity,
+            VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+            direct_write_properties, &instance_buffer);
+        VK_CHECK(vkd.MapMemory(device, instance_buffer.mem, 0, VK_WHOLE_SIZE, 0, &instance_buffer_mapped));
+    }
+    memcpy(instance_buffer_mapped, instances.data(), sizeof(VkAccelerationStructureInstanceKHR) * instances.size());
+
+    VkAccelerationStructureGeometryInstancesDataKHR instances_data = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR, nullptr };
+    instances_data.arrayOfPointers = VK_FALSE;
+    instances_data.data.deviceAddress = get_buffer_device_address(instance_buffer);
+
+    VkAccelerationStructureGeometryKHR geometry = { VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR, nullptr };
+    geometry.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR;
+    geometry.geometry.instances = instances_data;
+
+    // Frames are waited for, so nothing still traces the old TLAS
+    destroy_acceleration_structure(tlas);
+
+    begin_pass(commands, {
+        { RESOURCE_BLASES, VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_ACCESS_2_ACCELERATION_STRUCTURE_READ_BIT_KHR, false },
+        { RESOURCE_TLAS, VK_PIPELINE_STAGE_2_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_ACCESS_2_ACCELERATION_STRUCTURE_WRITE_BIT_KHR, true },
+    });
+    record_acceleration_structure_build(commands, VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR, geometry, instances.size(), &tlas, scratch);
+}
+
+void build_tlas()
+{
+    buffer scratch;
+    VkCommandBuffer commands = getCommandBuffer(true);
+    record_tlas_build(commands, &scratch);
+    flushCommandBuffer(commands);
+    destroy_buffer(scratch);
+}
+
+void set_translation(float transform[3][4], float x, float y, float z)
+{
+    for(int i = 0; i < 3; i++)
+        for(int j = 0; j < 4; j++)
+            transform[i][j] = (i == j) ? 1.0f : 0.0f;
+    transform[0][3] = x;
+    transform[1][3] = y;
+    transform[2][3] = z;
+}
+
+// Publish each mesh's vertex and index buffer addresses to the
+// closest-hit shaders.  The table is written in place when VRAM is
+// host-visible and small enough, leaving staging untouched; otherwise its
+// copy is recorded from staging, which must live until the commands complete.
+void record_mesh_table(VkCommandBuffer commands, buffer* staging)
+{
+    std::vector<mesh_info> infos;
+    for(auto& m : meshes) {
+        if(m.resident) {
+            infos.push_back({get_buffer_device_address(m.vertex_buffer), get_buffer_device_address(m.index_buffer)});
+        } else {
+            infos.push_back({0, 0});
+        }
+    }
+    if(mesh_table.buf != VK_NULL_HANDLE) {
+        destroy_buffer(mesh_table);
+    }
+    VkDeviceSize size = sizeof(mesh_info) * infos.size();
+    if(size <= direct_write_limit) {
+        create_device_buffer_with_data(infos.data(), size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, &mesh_table);
+        return;
+    }
+    begin_pass(commands, {{ RESOURCE_MESH_TABLE, VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, true }});
+    record_device_buffer_with_data(commands, infos.data(), size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, &mesh_table, staging);
+}
+
+void create_mesh_table()
+{
+    buffer staging = {};
+    VkCommandBuffer commands = getCommandBuffer(true);
+    record_mesh_table(commands, &staging);
+    flushCommandBuffer(commands);
+    destroy_buffer(staging);
+}
+
+// Anything that changes the image (camera, scene, pipeline variant) has
+// to throw away the samples gathered so far
+void reset_accumulation()
+{
+    accumulation.frame_count = 0;
+    accumulation.converged = false;
+    accumulation.started = std::chrono::steady_clock::now();
+}
+
+void set_camera(const float eye[3], const float at[3], float fov_degrees)
+{
+    float forward[3] = { at[0] - eye[0], at[1] - eye[1], at[2] - eye[2] };
+    float length = sqrtf(forward[0] * forward[0] + forward[1] * forward[1] + forward[2] * forward[2]);
+    for(int i = 0; i < 3; i++)
+        forward[i] /= length;
+
+    // right = forward x (0, 1, 0), up = right x forward
+    float right[3] = { -forward[2], 0, forward[0] };
+    length = sqrtf(right[0] * right[0] + right[2] * right[2]);
+    right[0] /= length;
+    right[2] /= length;
+    float up[3] = {
+        right[1] * forward[2] - right[2] * forward[1],
+        right[2] * forward[0] - right[0] * forward[2],
+        right[0] * forward[1] - right[1] * forward[0],
+    };
+
+    float half_height = tanf(fov_degrees / 2.0f * 3.14159265f / 180.0f);
+    float half_width = half_height * frame_width / frame_height;
+
+    for(int i = 0; i < 3; i++) {
+        camera.position[i] = eye[i];
+        camera.right[i] = right[i] * half_width;
+        camera.up[i] = up[i] * half_height;
+        camera.forward[i] = forward[i];
+    }
+    camera.position[3] = camera.right[3] = camera.up[3] = camera.forward[3] = 0.0f;
+
+    reset_accumulation();
+}
+
+void create_image(uint32_t width, uint32_t height, VkFormat format, VkImageUsageFlags usage, image* im)
+{
+    im->format = format;
+    im->width = width;
+    im->height = height;
+
+    VkImageCreateInfo create_image = {};
+    create_image.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    create_image.imageType = VK_IMAGE_TYPE_2D;
+    create_image.format = format;
+    create_image.extent = { width, height, 1 };
+    create_image.mipLevels = 1;
+    create_image.arrayLayers = 1;
+    create_image.samples = VK_SAMPLE_COUNT_1_BIT;
+    create_image.tiling = VK_IMAGE_TILING_OPTIMAL;
+    create_image.usage = usage;
+    create_image.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    create_image.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    VK_CHECK(vkd.CreateImage(device, &create_image, nullptr, &im->img));
+
+    VkMemoryRequirements memory_req = {};
+    vkd.GetImageMemoryRequirements(device, im->img, &memory_req);
+
+    VkMemoryAllocateInfo memory_alloc = {};
+    memory_alloc.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    memory_alloc.allocationSize = memory_req.size;
+    memory_alloc.memoryTypeIndex = getMemoryTypeIndex(memory_req.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    VK_CHECK(vkd.AllocateMemory(device, &memory_alloc, nullptr, &im->mem));
+    VK_CHECK(vkd.BindImageMemory(device, im->img, im->mem, 0));
+
+    VkImageViewCreateInfo create_view = {};
+    create_view.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    create_view.image = im->img;
+    create_view.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    create_view.format = format;
+    create_view.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+    VK_CHECK(vkd.CreateImageView(device, &create_view, nullptr, &im->view));
+
+    // Storage images stay in GENERAL layout for their whole life
+    VkImageMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.srcAccessMask = 0;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_READ_BIT;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    barrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = im->img;
+    barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+
+    VkCommandBuffer commands = getCommandBuffer(true);
+    vkd.CmdPipelineBarrier(commands, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+    flushCommandBuffer(commands);
+}
+
+void destroy_image(image& im)
+{
+    if(im.img != VK_NULL_HANDLE) {
+        vkd.DestroyImageView(device, im.view, nullptr);
+        vkd.DestroyImage(device, im.img, nullptr);
+        vkd.FreeMemory(device, im.mem, nullptr);
+        im.img = VK_NULL_HANDLE;
+    }
+}
+
+// 10-bit output needs storage image support for the packed format
+void choose_output_format()
+{
+    output_format = VK_FORMAT_R8G8B8A8_UNORM;
+    if(settings.output_bits == 10) {
+        VkFormatProperties properties;
+        vkGetPhysicalDeviceFormatProperties(physical_device, VK_FORMAT_A2B10G10R10_UNORM_PACK32, &properties);
+        if(properties.optimalTilingFeatures & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT) {
+            output_format = VK_FORMAT_A2B10G10R10_UNORM_PACK32;
+        } else {
+            std::cerr << "10-bit storage images aren't supported; writing 8-bit output\n";
+        }
+    }
+}
+
+void create_accumulation_targets()
+{
+    create_image(image_width, image_height, VK_FORMAT_R32G32B32A32_SFLOAT, VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, &accumulation_image);
+    create_image(image_width, image_height, VK_FORMAT_R32_UINT, VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, &sample_count_image);
+
+    // One entry (pixel index, sample count) per pixel at most
+    VkDeviceSize work_list_size = sizeof(work_list_header) + sizeof(uint32_t) * 2 * image_width * image_height;
+    create_buffer(work_list_size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &work_list);
+
+    tile_count_x = (image_width + tile_size - 1) / tile_size;
+    tile_count_y = (image_height + tile_size - 1) / tile_size;
+    VkDeviceSize size = sizeof(float) * tile_count_x * tile_count_y;
+    create_buffer(size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &tile_errors);
+    VK_CHECK(vkd.MapMemory(device, tile_errors.mem, 0, size, 0, (void**)&tile_errors_mapped));
+}
+
+void destroy_accumulation_targets()
+{
+    vkd.UnmapMemory(device, tile_errors.mem);
+    destroy_buffer(tile_errors);
+    destroy_buffer(work_list);
+    destroy_image(sample_count_image);
+    destroy_image(accumulation_image);
+}
+
+// Called after each accumulated frame has completed
+void update_convergence()
+{
+    uint32_t tile_total = tile_count_x * tile_count_y;
+    uint32_t converged_tiles = 0;
+    float worst_error = 0.0f;
+    for(uint32_t i = 0; i < tile_total; i++) {
+        worst_error = std::max(worst_error, tile_errors_mapped[i]);
+        if(tile_errors_mapped[i] <= settings.target_error) {
+            converged_tiles++;
+        }
+    }
+
+    bool below_target = (accumulation.frame_count >= settings.min_frames) && (converged_tiles == tile_total);
+    if(below_target || (accumulation.frame_count >= settings.max_frames)) {
+        accumulation.converged = true;
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - accumulation.started);
+        std::cout << (below_target ? "converged" : "reached frame limit") << " after " << accumulation.frame_count << " frames in " << elapsed.count() << " ms, worst tile error " << worst_error << "\n";
+    } else if(be_noisy) {
+        std::cout << "frame " << accumulation.frame_count << ": " << converged_tiles << " of " << tile_total << " tiles converged, worst error " << worst_error << "\n";
+    }
+}
+
+void create_descriptor_set_layout()
+{
+    VkDescriptorSetLayoutBinding bindings[] = {
+        {0, VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, 1, VK_SHADER_STAGE_RAYGEN_BIT_KHR, nullptr},
+        {1, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1, VK_SHADER_STAGE_COMPUTE_BIT, nullptr},
+        {2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, nullptr},
+        {3, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1, VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_COMPUTE_BIT, nullptr},
+        {4, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_RAYGEN_BIT_KHR, nullptr},
+        {5, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_COMPUTE_BIT, nullptr},
+        {6, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1, VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_COMPUTE_BIT, nullptr},
+    };
+
+    VkDescriptorSetLayoutCreateInfo create_layout = {};
+    create_layout.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    create_layout.bindingCount = sizeof(bindings) / sizeof(bindings[0]);
+    create_layout.pBindings = bindings;
+    VK_CHECK(vkd.CreateDescriptorSetLayout(device, &create_layout, nullptr, &descriptor_set_layout));
+
+    VkPushConstantRange push_constants = {};
+    push_constants.stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_KHR;
+    push_constants.offset = 0;
+    push_constants.size = sizeof(frame_constants);
+
+    VkPipelineLayoutCreateInfo create_pipeline_layout = {};
+    create_pipeline_layout.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    create_pipeline_layout.setLayoutCount = 1;
+    create_pipeline_layout.pSetLayouts = &descriptor_set_layout;
+    create_pipeline_layout.pushConstantRangeCount = 1;
+    create_pipeline_layout.pPushConstantRanges = &push_constants;
+    VK_CHECK(vkd.CreatePipelineLayout(device, &create_pipeline_layout, nullptr, &pipeline_layout));
+
+    VkPushConstantRange compute_push_constants = { VK_SHADER_STAGE_COMPUTE_BIT, 0, std::max(sizeof(work_list_constants), sizeof(tonemap_constants)) };
+    create_pipeline_layout.pPushConstantRanges = &compute_push_constants;
+    VK_CHECK(vkd.CreatePipelineLayout(device, &create_pipeline_layout, nullptr, &compute_pipeline_layout));
+
+    VkDescriptorPoolSize pool_sizes[] = {
+        {VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, 1},
+        {VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 3},
+        {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 3},
+    };
+
+    VkDescriptorPoolCreateInfo create_pool = {};
+    create_pool.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    create_pool.maxSets = 1;
+    create_pool.poolSizeCount = sizeof(pool_sizes) / sizeof(pool_sizes[0]);
+    create_pool.pPoolSizes = pool_sizes;
+    VK_CHECK(vkd.CreateDescriptorPool(device, &create_pool, nullptr, &descriptor_pool));
+
+    VkDescriptorSetAllocateInfo allocate_set = {};
+    allocate_set.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    allocate_set.descriptorPool = descriptor_pool;
+    allocate_set.descriptorSetCount = 1;
+    allocate_set.pSetLayouts = &descriptor_set_layout;
+    VK_CHECK(vkd.AllocateDescriptorSets(device, &allocate_set, &descriptor_set));
+}
+
+// Point the descriptor set at the current TLAS, images and buffers;
+// needed again whenever one of those is recreated
+void update_descriptor_set()
+{
+    VkWriteDescriptorSetAccelerationStructureKHR tlas_info = { VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET_ACCELERATION_STRUCTURE_KHR, nullptr };
+    tlas_info.accelerationStructureCount = 1;
+    tlas_info.pAccelerationStructures = &tlas.as;
+
+    VkDescriptorImageInfo image_info = { VK_NULL_HANDLE, output_image.view, VK_IMAGE_LAYOUT_GENERAL };
+    VkDescriptorBufferInfo mesh_table_info = { mesh_table.buf, 0, VK_WHOLE_SIZE };
+    VkDescriptorImageInfo accumulation_info = { VK_NULL_HANDLE, accumulation_image.view, VK_IMAGE_LAYOUT_GENERAL };
+    VkDescriptorBufferInfo tile_errors_info = { tile_errors.buf, 0, VK_WHOLE_SIZE };
+    VkDescriptorBufferInfo work_list_info = { work_list.buf, 0, VK_WHOLE_SIZE };
+    VkDescriptorImageInfo sample_count_info = { VK_NULL_HANDLE, sample_count_image.view, VK_IMAGE_LAYOUT_GENERAL };
+
+    VkWriteDescriptorSet writes[7] = {};
+    for(int i = 0; i < 7; i++) {
+        writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        writes[i].dstSet = descriptor_set;
+        writes[i].dstBinding = i;
+        writes[i].descriptorCount = 1;
+    }
+    writes[0].pNext = &tlas_info;
+    writes[0].descriptorType = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR;
+    writes[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    writes[1].pImageInfo = &image_info;
+    writes[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    writes[2].pBufferInfo = &mesh_table_info;
+    writes[3].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    writes[3].pImageInfo = &accumulation_info;
+    writes[4].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    writes[4].pBufferInfo = &tile_errors_info;
+    writes[5].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    writes[5].pBufferInfo = &work_list_info;
+    writes[6].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    writes[6].pImageInfo = &sample_count_info;
+
+    vkd.UpdateDescriptorSets(device, 7, writes, 0, nullptr);
+}
+
+const shader_bundle_entry& find_shader(const std::string& name)
+{
+    const shader_bundle_entry* begin = shader_bundle_entries;
+    const shader_bundle_entry* end = shader_bundle_entries + shader_bundle_entry_count;
+    const shader_bundle_entry* found = std::lower_bound(begin, end, name,
+        [](const shader_bundle_entry& entry, const std::string& name) { return strcmp(entry.name, name.c_str()) < 0; });
+
+    if(found == end || name != found->name) {
+        std::cerr << "no shader named " << name << " in the shader bundle\n";
+        exit(EXIT_FAILURE);
+    }
+    return *found;
+}
+
+VkShaderModule get_shader_module(const std::string& name)
+{
+    const shader_bundle_entry& shader = find_shader(name);
+
+    auto found = shader_modules.find(shader.hash);
+    if(found != shader_modules.end()) {
+        return found->second;
+    }
+
+    VkShaderModuleCreateInfo create_module = {};
+    create_module.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    create_module.codeSize = shader.word_count * sizeof(uint32_t);
+    create_module.pCode = shader_bundle_words + shader.offset;
+
+    VkShaderModule module;
+    VK_CHECK(vkd.CreateShaderModule(device, &create_module, nullptr, &module));
+    shader_modules[shader.hash] = module;
+
+    return module;
+}
+
+void destroy_shader_modules()
+{
+    for(auto& m : shader_modules) {
+        vkd.DestroyShaderModule(device, m.second, nullptr);
+    }
+    shader_modules.clear();
+}
+
+// Values for the specialization constants declared in shaders/common.glsl
+struct specialization_constants {
+    uint32_t max_bounces;
+    uint32_t samples_per_pixel;
+    VkBool32 any_hit_enabled;
+    uint32_t material_features;
+};
+
+const VkSpecializationMapEntry specialization_map[] = {
+    {0, offsetof(specialization_constants, max_bounces), sizeof(uint32_t)},
+    {1, offsetof(specialization_constants, samples_per_pixel), sizeof(uint32_t)},
+    {2, offsetof(specialization_constants, any_hit_enabled), sizeof(VkBool32)},
+    {3, offsetof(specialization_constants, material_features), sizeof(uint32_t)},
+};
+
+// Material feature bits; mirror MATERIAL_* in shaders/common.glsl
+const uint32_t MATERIAL_VERTEX_COLOR = 0x1;
+const uint32_t MATERIAL_CHECKER = 0x2;
+const uint32_t MATERIAL_CUTOUT = 0x4;
+
+// Pipelines are specialized per variant so the compiler can strip paths
+// a frame doesn't use, e.g. the bounce loop and any-hit for a preview
+struct pipeline_variant {
+    uint32_t max_bounces;
+    uint32_t samples_per_pixel;
+    bool any_hit_enabled;
+
+    bool operator<(const pipeline_variant& other) const
+    {
+        return std::tie(max_bounces, samples_per_pixel, any_hit_enabled) <
+            std::tie(other.max_bounces, other.samples_per_pixel, other.any_hit_enabled);
+    }
+};
+
+struct ray_tracing_pipeline {
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    uint32_t group_count = 0;
+    buffer sbt;
+    VkStridedDeviceAddressRegionKHR raygen_region = {};
+    VkStridedDeviceAddressRegionKHR miss_region = {};
+    VkStridedDeviceAddressRegionKHR hit_region = {};
+    VkStridedDeviceAddressRegionKHR callable_region = {};
+};
+
+// Everything a VkRayTracingPipelineCreateInfoKHR points to has to stay
+// alive until its deferred operation completes, so it is all kept here
+struct pipeline_compile {
+    std::string label;
+    std::vector<VkPipelineShaderStageCreateInfo> stages;
+    std::vector<VkRayTracingShaderGroupCreateInfoKHR> groups;
+    std::vector<VkPipeline> libraries;
+    specialization_constants constants;
+    VkSpecializationInfo specialization;
+    VkPipelineLibraryCreateInfoKHR library_info;
+    VkRayTracingPipelineInterfaceCreateInfoKHR library_interface;
+    VkRayTracingPipelineCreateInfoKHR create_info;
+    uint32_t group_count = 0;   // including groups from linked libraries
+    VkDeferredOperationKHR operation = VK_NULL_HANDLE;
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    VkResult result = VK_SUCCESS;
+    std::atomic<int> joining_threads {0};
+    std::atomic<bool> finished {false};
+    std::chrono::steady_clock::time_point started;
+};
+
+// Largest payload and hit attributes used by any shader in
+// shaders/*.glsl; every library and the linked pipeline must agree
+const uint32_t max_ray_payload_size = 64;
+const uint32_t max_ray_hit_attribute_size = 8;
+
+// A material is a hit group; its index is the SBT record offset that
+// instances using it carry.  Its library is compiled once per variant so
+// adding a material only costs compiling that material and a link.
+struct material {
+    std::string name;
+    uint32_t features;
+    std::map<pipeline_variant, std::shared_ptr<pipeline_compile>> libraries;
+};
+
+std::vector<material> materials;
+std::map<std::string, uint32_t> material_indices;
+
+// Everything compiled for one variant, created the first time a frame asks for it
+struct variant_pipelines {
+    std::shared_ptr<pipeline_compile> general_library;      // raygen and miss
+    std::shared_ptr<pipeline_compile> link;                 // in flight
+    std::unique_ptr<ray_tracing_pipeline> linked;           // ready to trace
+    bool link_needed = true;    // materials changed since the last link
+};
+
+std::map<pipeline_variant, variant_pipelines> variants;
+
+// What draw_frame traces with; may lag the settings while a variant compiles
+ray_tracing_pipeline* current_pipeline = nullptr;
+pipeline_variant current_variant;
+
+std::string describe_variant(const pipeline_variant& v)
+{
+    return "bounces " + std::to_string(v.max_bounces) + ", spp " + std::to_string(v.samples_per_pixel) + ", any-hit " + (v.any_hit_enabled ? "on" : "off");
+}
+
+void add_shader_stage(pipeline_compile& compile, VkShaderStageFlags stage, VkShaderModule module)
+{
+    VkPipelineShaderStageCreateInfo create_stage = {};
+    create_stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    create_stage.stage = stage;
+    create_stage.module = module;
+    create_stage.pName = "main";
+    create_stage.pSpecializationInfo = &compile.specialization;
+    compile.stages.push_back(create_stage);
+}
+
+void add_shader_group(pipeline_compile& compile, VkRayTracingShaderGroupTypeKHR type, uint32_t general, uint32_t closest_hit, uint32_t any_hit = VK_SHADER_UNUSED_KHR)
+{
+    VkRayTracingShaderGroupCreateInfoKHR group = { VK_STRUCTURE_TYPE_RAY_TRACING_SHADER_GROUP_CREATE_INFO_KHR, nullptr };
+    group.type = type;
+    group.generalShader = general;
+    group.closestHitShader = closest_hit;
+    group.anyHitShader = any_hit;
+    group.intersectionShader = VK_SHADER_UNUSED_KHR;
+    compile.groups.push_back(group);
+}
+
+void set_specialization(pipeline_compile& compile, const pipeline_variant& variant, uint32_t material_features)
+{
+    compile.constants.max_bounces = variant.max_bounces;
+    compile.constants.samples_per_pixel = variant.samples_per_pixel;
+    compile.constants.any_hit_enabled = variant.any_hit_enabled ? VK_TRUE : VK_FALSE;
+    compile.constants.material_features = material_features;
+
+    compile.specialization.mapEntryCount = sizeof(specialization_map) / sizeof(specialization_map[0]);
+    compile.specialization.pMapEntries = specialization_map;
+    compile.specialization.dataSize = sizeof(specialization_constants);
+    compile.specialization.pData = &compile.constants;
+}
+
+void set_library_interface(pipeline_compile& compile)
+{
+    compile.library_interface = { VK_STRUCTURE_TYPE_RAY_TRACING_PIPELINE_INTERFACE_CREATE_INFO_KHR, nullptr };
+    compile.library_interface.maxPipelineRayPayloadSize = max_ray_payload_size;
+    compile.library_interface.maxPipelineRayHitAttributeSize = max_ray_hit_attribute_size;
+}
+
+void set_create_info(pipeline_compile& compile, VkPipelineCreateFlags flags)
+{
+    set_library_interface(compile);
+
+    VkRayTracingPipelineCreateInfoKHR& create = compile.create_info;
+    create = { VK_STRUCTURE_TYPE_RAY_TRACING_PIPELINE_CREATE_INFO_KHR, nullptr };
+    create.flags = flags;
+    create.stageCount = compile.stages.size();
+    create.pStages = compile.stages.data();
+    create.groupCount = compile.groups.size();
+    create.pGroups = compile.groups.data();
+    create.maxPipelineRayRecursionDepth = 1;
+    create.pLibraryInterface = &compile.library_interface;
+    create.layout = pipeline_layout;
+
+    compile.group_count = compile.groups.size();
+}
+
+// Raygen then miss, the first two groups of every linked pipeline
+std::shared_ptr<pipeline_compile> describe_general_library(const pipeline_variant& variant)
+{
+    auto compile = std::make_shared<pipeline_compile>();
+    compile->label = "raygen/miss library (" + describe_variant(variant) + ")";
+    set_specialization(*compile, variant, 0);
+
+    add_shader_stage(*compile, VK_SHADER_STAGE_RAYGEN_BIT_KHR, get_shader_module("raygen.rgen"));
+    add_shader_stage(*compile, VK_SHADER_STAGE_MISS_BIT_KHR, get_shader_module("miss.rmiss"));
+
+    add_shader_group(*compile, VK_RAY_TRACING_SHADER_GROUP_TYPE_GENERAL_KHR, 0, VK_SHADER_UNUSED_KHR);
+    add_shader_group(*compile, VK_RAY_TRACING_SHADER_GROUP_TYPE_GENERAL_KHR, 1, VK_SHADER_UNUSED_KHR);
+
+    set_create_info(*compile, VK_PIPELINE_CREATE_LIBRARY_BIT_KHR);
+    return compile;
+}
+
+// Every material shares one closest-hit shader specialized by its feature
+// bits; cutout materials get an any-hit shader only in variants that enable it
+std::shared_ptr<pipeline_compile> describe_hit_group_library(const material& m, const pipeline_variant& variant)
+{
+    auto compile = std::make_shared<pipeline_compile>();
+    compile->label = "\"" + m.name + "\" material library (" + describe_variant(variant) + ")";
+    set_specialization(*compile, variant, m.features);
+
+    add_shader_stage(*compile, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR, get_shader_module("material.rchit"));
+    if((m.features & MATERIAL_CUTOUT) && variant.any_hit_enabled) {
+        add_shader_stage(*compile, VK_SHADER_STAGE_ANY_HIT_BIT_KHR, get_shader_module("cutout.rahit"));
+        add_shader_group(*compile, VK_RAY_TRACING_SHADER_GROUP_TYPE_TRIANGLES_HIT_GROUP_KHR, VK_SHADER_UNUSED_KHR, 0, 1);
+    } else {
+        add_shader_group(*compile, VK_RAY_TRACING_SHADER_GROUP_TYPE_TRIANGLES_HIT_GROUP_KHR, VK_SHADER_UNUSED_KHR, 0);
+    }
+
+    set_create_info(*compile, VK_PIPELINE_CREATE_LIBRARY_BIT_KHR);
+    return compile;
+}
+
+// Link the general library and every material's library, in material
+// order, so groups come out raygen, miss, then one hit group per material
+std::shared_ptr<pipeline_compile> describe_linked_pipeline(const variant_pipelines& vp, const pipeline_variant& variant)
+{
+    auto compile = std::make_shared<pipeline_compile>();
+    compile->label = "linked pipeline (" + describe_variant(variant) + ")";
+
+    compile->libraries.push_back(vp.general_library->pipeline);
+    for(auto& m : materials) {
+        compile->libraries.push_back(m.libraries.at(variant)->pipeline);
+    }
+
+    compile->library_info = { VK_STRUCTURE_TYPE_PIPELINE_LIBRARY_CREATE_INFO_KHR, nullptr };
+    compile->library_info.libraryCount = compile->libraries.size();
+    compile->library_info.pLibraries = compile->libraries.data();
+
+    set_create_info(*compile, 0);
+    compile->create_info.pLibraryInfo = &compile->library_info;
+    compile->group_count = vp.general_library->group_count + materials.size();
+
+    return compile;
+}
+
+void finish_pipeline_compile(pipeline_compile& compile)
+{
+    if(compile.operation != VK_NULL_HANDLE) {
+        compile.result = vkd.GetDeferredOperationResultKHR(device, compile.operation);
+        vkd.DestroyDeferredOperationKHR(device, compile.operation, nullptr);
+        compile.operation = VK_NULL_HANDLE;
+    }
+    if(be_noisy) {
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - compile.started);
+        std::cout << compile.label << " compiled in " << elapsed.count() << " ms\n";
+    }
+    compile.finished = true;
+}
+
+// Run a worker's share of the deferred compile; the last one out finishes it
+void join_pipeline_compile(std::shared_ptr<pipeline_compile> compile)
+{
+    VkResult result;
+    do {
+        result = vkd.DeferredOperationJoinKHR(device, compile->operation);
+        if(result == VK_THREAD_IDLE_KHR) {
+            std::this_thread::yield();
+        }
+    } while(result == VK_THREAD_IDLE_KHR);
+
+    if(--compile->joining_threads == 0) {
+        finish_pipeline_compile(*compile);
+    }
+}
+
+// Start compiling on the worker threads through a deferred operation; returns immediately
+void start_pipeline_compile(std::shared_ptr<pipeline_compile> compile)
+{
+    compile->started = std::chrono::steady_clock::now();
+    VK_CHECK(vkd.CreateDeferredOperationKHR(device, nullptr, &compile->operation));
+
+    VkResult result = vkd.CreateRayTracingPipelinesKHR(device, compile->operation, pipeline_cache, 1, &compile->create_info, nullptr, &compile->pipeline);
+
+    if(result == VK_OPERATION_DEFERRED_KHR) {
+        uint32_t concurrency = vkd.GetDeferredOperationMaxConcurrencyKHR(device, compile->operation);
+        uint32_t thread_count = std::max(1u, std::min(concurrency, workers->size()));
+        compile->joining_threads = thread_count;
+        for(uint32_t i = 0; i < thread_count; i++) {
+            workers->submit([compile]() { join_pipeline_compile(compile); });
+        }
+    } else {
+        // The implementation finished (or failed) without deferring
+        vkd.DestroyDeferredOperationKHR(device, compile->operation, nullptr);
+        compile->operation = VK_NULL_HANDLE;
+        compile->result = (result == VK_OPERATION_NOT_DEFERRED_KHR) ? VK_SUCCESS : result;
+        finish_pipeline_compile(*compile);
+    }
+}
+
+void wait_for_pipeline_compile(pipeline_compile& compile)
+{
+    while(!compile.finished) {
+        std::this_thread::yield();
+    }
+    VK_CHECK(compile.result);
+}
+
+// Fetch group handles and lay them out raygen | miss | hit, each region
+// starting on the required base alignment
+void create_shader_binding_table(ray_tracing_pipeline& rt)
+{
+    uint32_t handle_size = ray_tracing_pipeline_properties.shaderGroupHandleSize;
+    uint32_t handle_stride = align_up(handle_size, ray_tracing_pipeline_properties.shaderGroupHandleAlignment);
+    uint32_t base_alignment = ray_tracing_pipeline_properties.shaderGroupBaseAlignment;
+
+    uint32_t hit_group_count = rt.group_count - 2;
+    VkDeviceSize raygen_size = align_up(handle_stride, base_alignment);
+    VkDeviceSize miss_size = align_up(handle_stride, base_alignment);
+    VkDeviceSize hit_size = align_up(handle_stride * hit_group_count, base_alignment);
+
+    std::vector<uint8_t> handles(handle_size * rt.group_count);
+    VK_CHECK(vkd.GetRayTracingShaderGroupHandlesKHR(device, rt.pipeline, 0, rt.group_count, handles.size(), handles.data()));
+
+    VkDeviceSize sbt_size = raygen_size + miss_size + hit_size;
+    create_buffer(sbt_size, VK_BUFFER_USAGE_SHADER_BINDING_TABLE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+        direct_write_properties, &rt.sbt);
+
+    uint8_t *mapped;
+    VK_CHECK(vkd.MapMemory(device, rt.sbt.mem, 0, sbt_size, 0, (void**)&mapped));
+    memcpy(mapped, handles.data() + 0 * handle_size, handle_size);
+    memcpy(mapped + raygen_size, handles.data() + 1 * handle_size, handle_size);
+    for(uint32_t i = 0; i < hit_group_count; i++) {
+        memcpy(mapped + raygen_size + miss_size + i * handle_stride, handles.data() + (2 + i) * handle_size, handle_size);
+    }
+    vkd.UnmapMemory(device, rt.sbt.mem);
+
+    VkDeviceAddress sbt_address = get_buffer_device_address(rt.sbt);
+    rt.raygen_region = { sbt_address, raygen_size, raygen_size };
+    rt.miss_region = { sbt_address + raygen_size, handle_stride, miss_size };
+    rt.hit_region = { sbt_address + raygen_size + miss_size, handle_stride, hit_size };
+    rt.callable_region = { 0, 0, 0 };
+}
+
+void destroy_ray_tracing_pipeline(ray_tracing_pipeline& rt)
+{
+    vkd.DestroyPipeline(device, rt.pipeline, nullptr);
+    destroy_buffer(rt.sbt);
+}
+
+// Swap in a link compiled in the background once it is complete
+void install_finished_pipeline(variant_pipelines& vp)
+{
+    if(!vp.link || !vp.link->finished) {
+        return;
+    }
+
+    std::shared_ptr<pipeline_compile> compile = vp.link;
+    vp.link.reset();
+    VK_CHECK(compile->result);
+
+    std::unique_ptr<ray_tracing_pipeline> rt(new ray_tracing_pipeline);
+    rt->pipeline = compile->pipeline;
+    rt->group_count = compile->group_count;
+    create_shader_binding_table(*rt);
+
+    if(vp.linked) {
+        // Frames are submitted and waited on one at a time, so nothing
+        // still references the old pipeline
+        if(current_pipeline == vp.linked.get()) {
+            current_pipeline = rt.get();
+        }
+        destroy_ray_tracing_pipeline(*vp.linked);
+    }
+    vp.linked = std::move(rt);
+}
+
+// Start compiling whatever libraries a variant is still missing
+variant_pipelines& request_variant(const pipeline_variant& variant)
+{
+    variant_pipelines& vp = variants[variant];
+
+    if(!vp.general_library) {
+        vp.general_library = describe_general_library(variant);
+        start_pipeline_compile(vp.general_library);
+    }
+    for(auto& m : materials) {
+        if(m.libraries.find(variant) == m.libraries.end()) {
+            m.libraries[variant] = describe_hit_group_library(m, variant);
+            start_pipeline_compile(m.libraries[variant]);
+            vp.link_needed = true;
+        }
+    }
+    return vp;
+}
+
+// Register a material and start compiling its hit group library for
+// every variant requested so far.  Returns the SBT record offset for
+// instances using it; the offset is valid for tracing once the relinked
+// pipeline is installed.
+uint32_t add_material(const std::string& name, uint32_t features)
+{
+    auto found = material_indices.find(name);
+    if(found != material_indices.end()) {
+        return found->second;
+    }
+
+    material m;
+    m.name = name;
+    m.features = features;
+    materials.push_back(m);
+    material_indices[name] = materials.size() - 1;
+
+    for(auto& v : variants) {
+        request_variant(v.first);
+    }
+
+    return materials.size() - 1;
+}
+
+// Start a link once every library it needs has compiled and no other
+// link is in flight; install_finished_pipeline() picks up the result
+void link_pipeline_if_ready(variant_pipelines& vp, const pipeline_variant& variant)
+{
+    if(!vp.link_needed || vp.link) {
+        return;
+    }
+    if(!vp.general_library->finished) {
+        return;
+    }
+    for(auto& m : materials) {
+        if(!m.libraries.at(variant)->finished) {
+            return;
+        }
+    }
+
+    VK_CHECK(vp.general_library->result);
+    for(auto& m : materials) {
+        VK_CHECK(m.libraries.at(variant)->result);
+    }
+
+    vp.link = describe_linked_pipeline(vp, variant);
+    start_pipeline_compile(vp.link);
+    vp.link_needed = false;
+}
+
+// Any-hit only costs something if a material can use it
+pipeline_variant variant_for_settings()
+{
+    bool has_cutout = false;
+    for(auto& m : materials) {
+        has_cutout = has_cutout || (m.features & MATERIAL_CUTOUT);
+    }
+
+    pipeline_variant variant;
+    variant.max_bounces = settings.max_bounces;
+    variant.samples_per_pixel = settings.samples_per_pixel;
+    variant.any_hit_enabled = settings.any_hit_enabled && has_cutout;
+    return variant;
+}
+
+// Pick the pipeline for this frame.  A variant that isn't linked yet is
+// compiled in the background while frames keep using the last one; only
+// the very first frame (or a caller that asks to) has to wait.
+void choose_pipeline(bool wait_for_wanted = false)
+{
+    pipeline_variant wanted = variant_for_settings();
+    request_variant(wanted);
+
+    for(auto& v : variants) {
+        link_pipeline_if_ready(v.second, v.first);
+        install_finished_pipeline(v.second);
+    }
+
+    variant_pipelines& vp = variants.at(wanted);
+    if(!vp.linked && (!current_pipeline || wait_for_wanted)) {
+        while(!vp.linked) {
+            std::this_thread::yield();
+            link_pipeline_if_ready(vp, wanted);
+            install_finished_pipeline(vp);
+        }
+    }
+
+    if(vp.linked && (current_pipeline != vp.linked.get())) {
+        if(be_noisy && current_pipeline) {
+            std::cout << "switching to pipeline variant (" << describe_variant(wanted) << ")\n";
+        }
+        current_pipeline = vp.linked.get();
+        current_variant = wanted;
+        reset_accumulation();
+    }
+}
+
+void destroy_pipelines()
+{
+    for(auto& v : variants) {
+        variant_pipelines& vp = v.second;
+        if(vp.link) {
+            wait_for_pipeline_compile(*vp.link);
+            vkd.DestroyPipeline(device, vp.link->pipeline, nullptr);
+        }
+        if(vp.linked) {
+            destroy_ray_tracing_pipeline(*vp.linked);
+        }
+        wait_for_pipeline_compile(*vp.general_library);
+        vkd.DestroyPipeline(device, vp.general_library->pipeline, nullptr);
+    }
+    for(auto& m : materials) {
+        for(auto& l : m.libraries) {
+            wait_for_pipeline_compile(*l.second);
+            vkd.DestroyPipeline(device, l.second->pipeline, nullptr);
+        }
+    }
+    variants.clear();
+    materials.clear();
+    material_indices.clear();
+    current_pipeline = nullptr;
+}
+
+// The pipeline cache persists between runs so variants compiled once are
+// cheap to rebuild; the driver ignores data written by another device or driver
+std::string pipeline_cache_path()
+{
+    const char* path = getenv("VKRT_PIPELINE_CACHE");
+    return path ? path : "vkrt_pipeline_cache.bin";
+}
+
+void create_pipeline_cache()
+{
+    std::vector<uint8_t> data;
+    FILE *fp = fopen(pipeline_cache_path().c_str(), "rb");
+    if(fp) {
+        fseek(fp, 0, SEEK_END);
+        long size = ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+        if(size > 0) {
+            data.resize(size);
+            if(fread(data.data(), 1, size, fp) != size) {
+                data.clear();
+            }
+        }
+        fclose(fp);
+    }
+    if(be_noisy) {
+        std::cout << "pipeline cache: " << data.size() << " bytes loaded from " << pipeline_cache_path() << "\n";
+    }
+
+    VkPipelineCacheCreateInfo create_cache = {};
+    create_cache.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    create_cache.initialDataSize = data.size();
+    create_cache.pInitialData = data.empty() ? nullptr : data.data();
+    VK_CHECK(vkd.CreatePipelineCache(device, &create_cache, nullptr, &pipeline_cache));
+}
+
+VkPipeline create_compute_pipeline(const std::string& shader_name)
+{
+    VkComputePipelineCreateInfo create_pipeline = { VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO, nullptr };
+    create_pipeline.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    create_pipeline.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    create_pipeline.stage.module = get_shader_module(shader_name);
+    create_pipeline.stage.pName = "main";
+    create_pipeline.layout = compute_pipeline_layout;
+
+    VkPipeline pipeline;
+    VK_CHECK(vkd.CreateComputePipelines(device, pipeline_cache, 1, &create_pipeline, nullptr, &pipeline));
+    return pipeline;
+}
+
+void save_pipeline_cache()
+{
+    size_t size;
+    VK_CHECK(vkd.GetPipelineCacheData(device, pipeline_cache, &size, nullptr));
+    std::vector<uint8_t> data(size);
+    VK_CHECK(vkd.GetPipelineCacheData(device, pipeline_cache, &size, data.data()));
+
+#ifndef _WIN32
+    // Every device process saves at exit, so each writes its own file and
+    // renames it into place; the cache is never a mix of two writers
+    std::string path = pipeline_cache_path() + "." + std::to_string(getpid());
+#else
+    std::string path = pipeline_cache_path();
+#endif
+    FILE *fp = fopen(path.c_str(), "wb");
+    if(!fp) {
+        std::cerr << "couldn't open " << path << " to save pipeline cache\n";
+        return;
+    }
+    bool written = fwrite(data.data(), 1, size, fp) == size;
+    written = (fclose(fp) == 0) && written;
+    if(!written) {
+        std::cerr << "couldn't write pipeline cache to " << path << "\n";
+        remove(path.c_str());
+        return;
+    }
+#ifndef _WIN32
+    if(rename(path.c_str(), pipeline_cache_path().c_str()) != 0) {
+        std::cerr << "couldn't replace " << pipeline_cache_path() << " with the new pipeline cache\n";
+        remove(path.c_str());
+    }
+#endif
+}
+
+std::string current_scene;
+
+uint32_t get_cached_mesh(const std::string& key, std::function<uint32_t()> create)
+{
+    auto found = mesh_cache.find(key);
+    if(found != mesh_cache.end()) {
+        return found->second;
+    }
+    uint32_t index = create();
+    mesh_cache[key] = index;
+    return index;
+}
+
+// Positions and optional per-vertex colors ("v x y z r g b"); polygons
+// are fanned into triangles.  Returns false if the file can't be read.
+bool load_obj(const std::string& filename, std::vector<Vertex>& obj_vertices, std::vector<uint32_t>& obj_indices)
+{
+    FILE *fp = fopen(filename.c_str(), "r");
+    if(!fp) {
+        return false;
+    }
+
+    char line[1024];
+    while(fgets(line, sizeof(line), fp)) {
+        if(line[0] == 'v' && line[1] == ' ') {
+            Vertex v = {{0, 0, 0}, {.8f, .8f, .8f}};
+            sscanf(line + 2, "%f %f %f %f %f %f", &v.v[0], &v.v[1], &v.v[2], &v.c[0], &v.c[1], &v.c[2]);
+            obj_vertices.push_back(v);
+        } else if(line[0] == 'f' && line[1] == ' ') {
+            std::vector<uint32_t> face;
+            char *p = line + 2;
+            while(*p) {
+                char *end;
+                long index = strtol(p, &end, 10);
+                if(end == p) {
+                    p++;
+                    continue;
+                }
+                // Negative indices count back from the latest vertex
+                face.push_back((index < 0) ? obj_vertices.size() + index : index - 1);
+                // Skip any /texcoord/normal references
+                p = end;
+                while(*p && *p != ' ' && *p != '\t') {
+                    p++;
+                }
+            }
+            for(size_t i = 2; i < face.size(); i++) {
+                obj_indices.insert(obj_indices.end(), {face[0], face[i - 1], face[i]});
+            }
+        }
+    }
+    fclose(fp);
+
+    for(uint32_t index : obj_indices) {
+        if(index >= obj_vertices.size()) {
+            return false;
+        }
+    }
+    return !obj_indices.empty();
+}
+
+void add_ground(float y, float size)
+{
+    uint32_t ground = get_cached_mesh("builtin:ground", []() { return create_mesh(quad_vertices, 4, quad_indices, 6); });
+
+    float transform[3][4];
+    set_translation(transform, 0, y, 0);
+    for(int i = 0; i < 3; i++)
+        transform[i][i] = size;
+    add_instance(ground, transform, 0xff, material_indices.at("checker"), 0);
+}
+
+void populate_builtin_scene()
+{
+    uint32_t vertex_color = material_indices.at("vertex_color");
+    uint32_t leaf = material_indices.at("leaf");
+
+    uint32_t triangle = get_cached_mesh("builtin:triangle", []() { return create_mesh(vertices, 3, indices, 3); });
+
+    add_ground(-.5f, 64.0f);
+
+    // A forest of triangles, all sharing one BLAS; every third one is a
+    // cutout leaf, which has to be non-opaque for its any-hit shader to run
+    float transform[3][4];
+    const int forest_size = 64;
+    for(int j = 0; j < forest_size; j++) {
+        for(int i = 0; i < forest_size; i++) {
+            set_translation(transform, (i - forest_size / 2) * 1.5f, -.5f, (j - forest_size / 2) * 1.5f);
+            if((i + j) % 3 == 0) {
+                add_instance(triangle, transform, 0xff, leaf, VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR | VK_GEOMETRY_INSTANCE_FORCE_NO_OPAQUE_BIT_KHR);
+            } else {
+                add_instance(triangle, transform, 0xff, vertex_color, VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR);
+            }
+        }
+    }
+}
+
+// An OBJ model standing on a ground plane sized to it
+bool populate_obj_scene(const std::string& filename)
+{
+    bool loaded = true;
+    uint32_t model = get_cached_mesh(filename, [&]() -> uint32_t {
+        std::vector<Vertex> obj_vertices;
+        std::vector<uint32_t> obj_indices;
+        if(!load_obj(filename, obj_vertices, obj_indices)) {
+            loaded = false;
+            return 0;
+        }
+        return create_mesh_with_lods(obj_vertices, obj_indices);
+    });
+    if(!loaded) {
+        mesh_cache.erase(filename);
+        return false;
+    }
+
+    float transform[3][4];
+    set_translation(transform, 0, 0, 0);
+    add_instance(model, transform, 0xff, material_indices.at("vertex_color"), VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR);
+    add_ground(meshes[model].bounds_min[1], 8.0f * meshes[model].radius);
+    return true;
+}
+
+// Streamed scenes ("stream:chunks.txt") list OBJ chunks, one "path x y z"
+// line each, with paths relative to the list.  Chunks within
+// STREAM_RADIUS of the camera are read on a loader thread, uploaded with
+// submissions the render loop polls instead of waiting on, and added to
+// the TLAS once resident, so the first frame doesn't wait for any of them.
+enum chunk_state {
+    CHUNK_UNLOADED,
+    CHUNK_LOADING,      // queued for or being read by the loader
+    CHUNK_LOADED,       // has a mesh, not placed
+    CHUNK_UPLOADING,
+    CHUNK_PLACED,
+    CHUNK_FAILED,
+};
+
+struct stream_chunk {
+    std::string path;
+    float position[3];
+    chunk_state state = CHUNK_UNLOADED;
+    uint32_t mesh_index = 0;
+    uint32_t instance = UINT32_MAX;     // in the last placement, while placed
+    uint32_t lod = LOD_UNCHOSEN;        // carried across placements
+    // Filled by the loader, handed over through stream_loaded
+    std::vector<Vertex> vertices;
+    std::vector<uint32_t> indices;
+    bool failed = false;
+};
+
+struct stream_upload {
+    std::shared_ptr<upload_batch> batch;
+    std::vector<uint32_t> chunks;
+};
+
+// stream_chunks isn't resized while the loader runs
+std::vector<stream_chunk> stream_chunks;
+std::vector<stream_upload> stream_uploads;
+float stream_radius = 100.0f;
+
+std::thread stream_loader;
+std::mutex stream_mutex;
+std::condition_variable stream_wake;
+std::deque<uint32_t> stream_requests;       // nearest first
+std::vector<uint32_t> stream_loaded;
+bool stream_quit = false;
+
+void stream_loader_main()
+{
+    std::unique_lock<std::mutex> lock(stream_mutex);
+    while(true) {
+        stream_wake.wait(lock, []() { return stream_quit || !stream_requests.empty(); });
+        if(stream_quit) {
+            return;
+        }
+        uint32_t index = stream_requests.front();
+        stream_requests.pop_front();
+        stream_chunk& chunk = stream_chunks[index];
+        lock.unlock();
+        chunk.failed = !load_obj(chunk.path, chunk.vertices, chunk.indices);
+        lock.lock();
+        stream_loaded.push_back(index);
+    }
+}
+
+bool read_chunk_list(const std::string& list, std::vector<stream_chunk>& chunks)
+{
+    FILE *fp = fopen(list.c_str(), "r");
+    if(!fp) {
+        return false;
+    }
+    std::string directory = (list.find('/') == std::string::npos) ? "" : list.substr(0, list.rfind('/') + 1);
+    char line[1024];
+    char path[1024];
+    while(fgets(line, sizeof(line), fp)) {
+        stream_chunk chunk;
+        if(line[0] == '#' || sscanf(line, "%1023s %f %f %f", path, &chunk.position[0], &chunk.position[1], &chunk.position[2]) != 4) {
+            continue;
+        }
+        chunk.path = (path[0] == '/') ? path : directory + path;
+        chunks.push_back(chunk);
+    }
+    fclose(fp);
+    return !chunks.empty();
+}
+
+void start_streaming(std::vector<stream_chunk>& chunks)
+{
+    stream_chunks.swap(chunks);
+    stream_quit = false;
+    stream_loader = std::thread(stream_loader_main);
+    if(be_noisy) {
+        std::cout << "streaming " << stream_chunks.size() << " chunks\n";
+    }
+}
+
+// Stop the loader and let uploads in flight finish
+void stop_streaming()
+{
+    if(stream_loader.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(stream_mutex);
+            stream_quit = true;
+        }
+        stream_wake.notify_all();
+        stream_loader.join();
+    }
+    for(auto& upload : stream_uploads) {
+        wait_for_uploads(*upload.batch);
+    }
+    stream_uploads.clear();
+    stream_chunks.clear();
+    stream_requests.clear();
+    stream_loaded.clear();
+}
+
+// LODs the camera asked for that are still being uploaded
+std::shared_ptr<upload_batch> lod_uploads;
+
+// Let LOD uploads in flight finish without switching instances to them
+void drain_lod_uploads()
+{
+    if(lod_uploads) {
+        wait_for_uploads(*lod_uploads);
+        lod_uploads.reset();
+    }
+}
+
+// Place the chunks whose meshes are resident; the next frame rebuilds
+// the TLAS over them
+void place_streamed_chunks()
+{
+    uint64_t placed_since = residency_clock;
+    for(auto& chunk : stream_chunks) {
+        if(chunk.instance < instance_lods.size() && instance_meshes[chunk.instance] == chunk.mesh_index) {
+            chunk.lod = instance_lods[chunk.instance];
+        }
+        chunk.instance = UINT32_MAX;
+    }
+    instances.clear();
+    instance_meshes.clear();
+    instance_lods.clear();
+    float transform[3][4];
+    for(auto& chunk : stream_chunks) {
+        if(chunk.state == CHUNK_PLACED) {
+            set_translation(transform, chunk.position[0], chunk.position[1], chunk.position[2]);
+            chunk.instance = instances.size();
+            add_instance(chunk.mesh_index, transform, 0xff, material_indices.at("vertex_color"), VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR);
+            instance_lods.back() = chunk.lod;
+        }
+    }
+    // Every placed chunk's LOD is resident; update_lods moves them on
+    // without waiting once the camera asks for others
+    std::vector<uint32_t> placed = lod_instance_meshes();
+    for(uint32_t index : placed) {
+        assert(meshes[index].resident);
+    }
+    touch_meshes(placed);
+    enforce_geometry_budget(placed_since);
+    scene_update_pending = true;
+    reset_accumulation();
+}
+
+float camera_distance(const stream_chunk& chunk)
+{
+    float d[3] = { chunk.position[0] - camera.position[0], chunk.position[1] - camera.position[1], chunk.position[2] - camera.position[2] };
+    return sqrtf(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+}
+
+// Called once per frame: request chunks that came into range, start
+// uploading what the loader has read, and place chunks whose uploads
+// are done.  Never waits on the disk or the GPU.
+void update_streaming()
+{
+    if(stream_chunks.empty()) {
+        return;
+    }
+    bool changed = false;
+
+    {
+        std::lock_guard<std::mutex> lock(stream_mutex);
+        for(uint32_t index : stream_loaded) {
+            stream_chunk& chunk = stream_chunks[index];
+            if(chunk.failed) {
+                std::cerr << "couldn't load chunk " << chunk.path << "\n";
+                chunk.state = CHUNK_FAILED;
+            } else {
+                chunk.mesh_index = get_cached_mesh(chunk.path, [&]() { return create_mesh_with_lods(chunk.vertices, chunk.indices); });
+                mark_in_scene(chunk.mesh_index);
+                chunk.state = CHUNK_LOADED;
+            }
+            chunk.vertices = std::vector<Vertex>();
+            chunk.indices = std::vector<uint32_t>();
+        }
+        stream_loaded.clear();
+    }
+
+    // Chunks leave at a larger radius than they enter at, so ones on the
+    // boundary don't flicker in and out as the camera moves
+    std::vector<std::pair<float, uint32_t>> wanted;
+    std::vector<uint32_t> upload_chunks;
+    std::set<uint32_t> upload_meshes;
+    for(uint32_t i = 0; i < stream_chunks.size(); i++) {
+        stream_chunk& chunk = stream_chunks[i];
+        float d = camera_distance(chunk);
+        if(chunk.state == CHUNK_UNLOADED && d <= stream_radius) {
+            auto cached = mesh_cache.find(chunk.path);
+            if(cached != mesh_cache.end()) {
+                chunk.mesh_index = cached->second;
+                mark_in_scene(chunk.mesh_index);
+                chunk.state = CHUNK_LOADED;
+            } else {
+                wanted.push_back({d, i});
+            }
+        }
+        if(chunk.state == CHUNK_PLACED && d > stream_radius * 1.25f) {
+            chunk.state = CHUNK_LOADED;
+            changed = true;
+        } else if(chunk.state == CHUNK_LOADED && d <= stream_radius) {
+            // Only the LOD the chunk is seen at is uploaded.  A mesh some
+            // other batch is bringing back isn't waited for: that batch is
+            // finished here if its GPU work and host builds are done, whoever
+            // started it, and otherwise the chunk stays loaded and is
+            // checked again next frame.
+            float transform[3][4];
+            set_translation(transform, chunk.position[0], chunk.position[1], chunk.position[2]);
+            uint32_t level = choose_lod(chunk.mesh_index, transform, chunk.lod);
+            uint32_t index = lod_mesh(chunk.mesh_index, level);
+            mesh& m = meshes[index];
+            if(m.uploading && uploads_finished(*m.uploading)) {
+                finish_uploads(*m.uploading);
+            }
+            if(m.resident) {
+                chunk.lod = level;
+                chunk.state = CHUNK_PLACED;
+                changed = true;
+            } else if(!m.uploading && upload_meshes.insert(index).second) {
+                chunk.lod = level;
+                chunk.state = CHUNK_UPLOADING;
+                upload_chunks.push_back(i);
+            }
+        }
+    }
+
+    if(!wanted.empty()) {
+        std::sort(wanted.begin(), wanted.end());
+        {
+            std::lock_guard<std::mutex> lock(stream_mutex);
+            for(const auto& w : wanted) {
+                stream_chunks[w.second].state = CHUNK_LOADING;
+                stream_requests.push_back(w.second);
+            }
+        }
+        stream_wake.notify_one();
+    }
+
+    if(!upload_chunks.empty()) {
+        stream_uploads.push_back({ start_uploads(std::vector<uint32_t>(upload_meshes.begin(), upload_meshes.end())), upload_chunks });
+    }
+
+    for(auto upload = stream_uploads.begin(); upload != stream_uploads.end(); ) {
+        if(uploads_finished(*upload->batch)) {
+            finish_uploads(*upload->batch);
+            for(uint32_t index : upload->chunks) {
+                stream_chunks[index].state = CHUNK_PLACED;
+            }
+            changed = true;
+            upload = stream_uploads.erase(upload);
+        } else {
+            ++upload;
+        }
+    }
+
+    if(changed) {
+        place_streamed_chunks();
+    }
+}
+
+// Offline renders wait for every chunk in range, so the image doesn't
+// depend on how far streaming had got
+void wait_for_streaming()
+{
+    auto busy = []() {
+        return std::any_of(stream_chunks.begin(), stream_chunks.end(), [](const stream_chunk& chunk) {
+            return chunk.state == CHUNK_LOADING || chunk.state == CHUNK_UPLOADING ||
+                (chunk.state == CHUNK_LOADED && camera_distance(chunk) <= stream_radius);
+        });
+    };
+    update_streaming();
+    while(busy()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        update_streaming();
+    }
+}
+
+// Replace the instances with a named scene ("builtin", an OBJ file, or
+// "stream:" and a chunk list) and rebuild the TLAS; the descriptor set
+// must be updated afterwards
+bool set_scene(const std::string& name)
+{
+    uint64_t scene_start = residency_clock;
+
+    // Populate fresh instance lists, keeping the old ones (which the TLAS
+    // and mesh table still describe) in case the new scene can't be loaded
+    std::vector<VkAccelerationStructureInstanceKHR> previous_instances;
+    std::vector<uint32_t> previous_meshes, previous_lods;
+    instances.swap(previous_instances);
+    instance_meshes.swap(previous_meshes);
+    instance_lods.swap(previous_lods);
+
+    std::vector<stream_chunk> chunks;
+    bool loaded = true;
+    if(name == "builtin") {
+        populate_builtin_scene();
+    } else if(name.compare(0, 7, "stream:") == 0) {
+        loaded = read_chunk_list(name.substr(7), chunks);
+        if(!loaded) {
+            std::cerr << "couldn't read chunk list " << name.substr(7) << "\n";
+        }
+    } else if(!populate_obj_scene(name)) {
+        std::cerr << "couldn't load scene " << name << "\n";
+        loaded = false;
+    }
+    if(!loaded) {
+        instances.swap(previous_instances);
+        instance_meshes.swap(previous_meshes);
+        instance_lods.swap(previous_lods);
+        return false;
+    }
+
+    stop_streaming();
+    drain_lod_uploads();
+
+    // Meshes only earlier scenes used are forgotten once they're evicted
+    for(auto& m : meshes) {
+        m.in_scene = false;
+    }
+    for(uint32_t index : instance_meshes) {
+        mark_in_scene(index);
+    }
+    forget_unused_meshes();
+
+    if(!chunks.empty()) {
+        start_streaming(chunks);
+    }
+
+    select_lods();
+    make_resident(lod_instance_meshes());
+    build_tlas();
+    enforce_geometry_budget(scene_start);
+    create_mesh_table();
+    scene_update_pending = false;
+    current_scene = name;
+    return true;
+}
+
+// Called once per frame: move instances to the LODs the camera now asks
+// for.  LODs that aren't resident are uploaded in the background and the
+// instances keep their current ones until the upload is done; the next
+// frame rebuilds the TLAS.  Never waits on the GPU.
+void update_lods()
+{
+    if(lod_uploads) {
+        if(!uploads_finished(*lod_uploads)) {
+            return;
+        }
+        finish_uploads(*lod_uploads);
+        lod_uploads.reset();
+    }
+
+    std::vector<uint32_t> previous = instance_lods;
+    if(!select_lods()) {
+        return;
+    }
+    std::vector<uint32_t> missing;
+    for(size_t i = 0; i < instances.size(); i++) {
+        uint32_t index = lod_mesh(instance_meshes[i], instance_lods[i]);
+        if(!meshes[index].resident) {
+            missing.push_back(index);
+            instance_lods[i] = previous[i];
+        }
+    }
+
+    uint64_t selected_since = residency_clock;
+    std::vector<uint32_t> used = lod_instance_meshes();
+    used.insert(used.end(), missing.begin(), missing.end());
+    lod_uploads = start_uploads(used);
+    if(lod_uploads->uploads.empty()) {
+        lod_uploads.reset();
+    }
+
+    if(instance_lods != previous) {
+        enforce_geometry_budget(selected_since);
+        scene_update_pending = true;
+        reset_accumulation();
+    }
+}
+
+// Offline renders wait for the LODs the camera asks for, so the image
+// doesn't depend on how far the uploads had got
+void wait_for_lods()
+{
+    update_lods();
+    while(lod_uploads) {
+        wait_for_uploads(*lod_uploads);
+        lod_uploads.reset();
+        update_lods();
+    }
+}
+
+void create_scene()
+{
+    // The camera comes first since LODs are chosen for it
+    float eye[3] = {0, 8, -50};
+    float at[3] = {0, 0, 0};
+    set_camera(eye, at, 45);
+
+    const char *scene = getenv("SCENE");
+    if(!set_scene(scene ? scene : "builtin")) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Saved frames are copied into a ring of host buffers and encoded on the
+// encoder pool; the render thread only waits when every slot is still
+// being encoded, so at most readback_slot_count frames are ever held in
+// memory however slow the disk is.
+enum image_encoding {
+    ENCODING_PPM,
+    ENCODING_PNG,
+    ENCODING_EXR_HALF,      // HDR, from the accumulation image
+    ENCODING_EXR_FLOAT,
+};
+
+struct readback_slot {
+    buffer staging;         // HOST_CACHED where available, so reading it back is fast
+    uint8_t *pixels;
+    uint64_t copied = 0;    // timeline value signalled when the copy is done
+    VkCommandBuffer commands = VK_NULL_HANDLE;
+    std::string filename;
+    image_encoding encoding;
+    VkFormat format;        // of the output image when it was copied
+    uint32_t width, height;
+    bool busy = false;      // submitted and not yet written
+};
+
+const int readback_slot_count = 4;
+readback_slot readback_slots[readback_slot_count];
+int next_readback_slot = 0;
+
+std::mutex readback_mutex;
+std::condition_variable readback_changed;
+std::unique_ptr<thread_pool> encoders;
+
+bool has_memory_type(VkMemoryPropertyFlags properties)
+{
+    for(uint32_t i = 0; i < memory_properties.memoryTypeCount; i++) {
+        if((memory_properties.memoryTypes[i].propertyFlags & properties) == properties) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Pick where the host writes data the GPU reads in place.  A host-visible
+// device-local heap bigger than the classic 256MB window means resizable
+// BAR is on, and larger static uploads can skip staging too.
+void choose_direct_write_memory()
+{
+    const VkMemoryPropertyFlags mapped_vram = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    VkDeviceSize window = 0;
+    for(uint32_t i = 0; i < memory_properties.memoryTypeCount; i++) {
+        if((memory_properties.memoryTypes[i].propertyFlags & mapped_vram) == mapped_vram) {
+            window = std::max(window, memory_properties.memoryHeaps[memory_properties.memoryTypes[i].heapIndex].size);
+        }
+    }
+    if(window == 0 || getenv("NO_DIRECT_WRITE") != NULL) {
+        return;
+    }
+
+    direct_write_properties = mapped_vram;
+    direct_write_limit = (window > 256 * 1024 * 1024) ? 64 * 1024 * 1024 : 1024 * 1024;
+    if(be_noisy) {
+        printf("writing small uploads straight to %llu MB of host-visible VRAM%s\n", (unsigned long long)(window / (1024 * 1024)),
+            (window > 256 * 1024 * 1024) ? " (resizable BAR)" : "");
+    }
+}
+
+image_encoding encoding_for_filename(const std::string& filename)
+{
+    auto ends_with = [&](const char *suffix) {
+        size_t n = strlen(suffix);
+        return filename.size() >= n && filename.compare(filename.size() - n, n, suffix) == 0;
+    };
+    if(ends_with(".png")) {
+        return ENCODING_PNG;
+    }
+    if(ends_with(".exr")) {
+        return (getenv("EXR_FLOAT") != NULL) ? ENCODING_EXR_FLOAT : ENCODING_EXR_HALF;
+    }
+    return ENCODING_PPM;
+}
+
+// Output pixels are 4 bytes, RGBA8 or A2B10G10R10; channels come back
+// as 8- or 10-bit values
+void unpack_rgb(const uint8_t *pixel, VkFormat format, uint16_t rgb[3])
+{
+    if(format == VK_FORMAT_A2B10G10R10_UNORM_PACK32) {
+        uint32_t packed;
+        memcpy(&packed, pixel, sizeof(packed));
+        rgb[0] = packed & 0x3ff;
+        rgb[1] = (packed >> 10) & 0x3ff;
+        rgb[2] = (packed >> 20) & 0x3ff;
+    } else {
+        rgb[0] = pixel[0];
+        rgb[1] = pixel[1];
+        rgb[2] = pixel[2];
+    }
+}
+
+// 10-bit output is written as 16-bit samples with a maxval of 1023
+uint32_t ppm_bytes_per_pixel(VkFormat format)
+{
+    return (format == VK_FORMAT_A2B10G10R10_UNORM_PACK32) ? 6 : 3;
+}
+
+void write_ppm_header(FILE *fp, uint32_t width, uint32_t height, VkFormat format)
+{
+    fprintf(fp, "P6\n%u %u\n%u\n", width, height, (format == VK_FORMAT_A2B10G10R10_UNORM_PACK32) ? 1023 : 255);
+}
+
+void convert_ppm_row(const uint8_t *src, uint32_t width, VkFormat format, uint8_t *row)
+{
+    bool wide = (ppm_bytes_per_pixel(format) == 6);
+    for(uint32_t x = 0; x < width; x++) {
+        uint16_t rgb[3];
+        unpack_rgb(src + 4 * x, format, rgb);
+        for(int c = 0; c < 3; c++) {
+            if(wide) {
+                row[6 * x + 2 * c + 0] = rgb[c] >> 8;
+                row[6 * x + 2 * c + 1] = rgb[c] & 0xff;
+            } else {
+                row[3 * x + c] = rgb[c];
+            }
+        }
+    }
+}
+
+void write_ppm(const std::string& filename, const uint8_t *pixels, uint32_t width, uint32_t height, VkFormat format)
+{
+    FILE *fp = fopen(filename.c_str(), "wb");
+    if(!fp) {
+        std::cerr << "couldn't open " << filename << " for writing\n";
+        return;
+    }
+    write_ppm_header(fp, width, height, format);
+    std::vector<uint8_t> row(ppm_bytes_per_pixel(format) * width);
+    for(uint32_t y = 0; y < height; y++) {
+        convert_ppm_row(pixels + 4 * width * y, width, format, row.data());
+        fwrite(row.data(), 1, row.size(), fp);
+    }
+    fclose(fp);
+}
+
+void put_be32(std::vector<uint8_t>& out, uint32_t v)
+{
+    out.push_back(v >> 24);
+    out.push_back(v >> 16);
+    out.push_back(v >> 8);
+    out.push_back(v);
+}
+
+uint32_t png_crc(const uint8_t *data, size_t size, uint32_t crc = 0)
+{
+    static uint32_t table[256];
+    static std::once_flag table_ready;
+    std::call_once(table_ready, []() {
+        for(uint32_t n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for(int k = 0; k < 8; k++)
+                c = (c & 1) ? (0xedb88320u ^ (c >> 1)) : (c >> 1);
+            table[n] = c;
+        }
+    });
+
+    crc = ~crc;
+    for(size_t i = 0; i < size; i++)
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+void put_png_chunk(std::vector<uint8_t>& out, const char *type, const std::vector<uint8_t>& data)
+{
+    put_be32(out, data.size());
+    size_t start = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data.begin(), data.end());
+    put_be32(out, png_crc(out.data() + start, out.size() - start));
+}
+
+// A zlib stream for the filtered scanlines; without zlib the data is
+// stored uncompressed, which any PNG reader accepts
+std::vector<uint8_t> png_deflate(const std::vector<uint8_t>& raw)
+{
+#ifdef HAVE_ZLIB
+    uLongf size = compressBound(raw.size());
+    std::vector<uint8_t> out(size);
+    if(compress2(out.data(), &size, raw.data(), raw.size(), 6) != Z_OK) {
+        std::cerr << "zlib compression failed\n";
+        exit(EXIT_FAILURE);
+    }
+    out.resize(size);
+    return out;
+#else
+    std::vector<uint8_t> out = {0x78, 0x01};
+    size_t offset = 0;
+    do {
+        size_t block = std::min<size_t>(raw.size() - offset, 65535);
+        bool last = (offset + block == raw.size());
+        out.push_back(last ? 1 : 0);
+        out.push_back(block & 0xff);
+        out.push_back(block >> 8);
+        out.push_back(~block & 0xff);
+        out.push_back((~block >> 8) & 0xff);
+        out.insert(out.end(), raw.begin() + offset, raw.begin() + offset + block);
+        offset += block;
+    } while(offset < raw.size());
+
+    uint32_t a = 1, b = 0;
+    for(uint8_t byte : raw) {
+        a = (a + byte) % 65521;
+        b = (b + a) % 65521;
+    }
+    put_be32(out, (b << 16) | a);
+    return out;
+#endif
+}
+
+void write_png(const std::string& filename, const uint8_t *pixels, uint32_t width, uint32_t height, VkFormat format)
+{
+    // 10-bit output is widened to 16-bit samples
+    bool wide = (format == VK_FORMAT_A2B10G10R10_UNORM_PACK32);
+    uint32_t bytes_per_pixel = wide ? 6 : 3;
+
+    // Each row is stored with the Sub filter (difference from the byte
+    // one pixel to the left), which compresses rendered gradients much better
+    std::vector<uint8_t> raw;
+    std::vector<uint8_t> row(bytes_per_pixel * width);
+    raw.reserve((row.size() + 1) * height);
+    for(uint32_t y = 0; y < height; y++) {
+        for(uint32_t x = 0; x < width; x++) {
+            uint16_t rgb[3];
+            unpack_rgb(pixels + 4 * (width * y + x), format, rgb);
+            for(int c = 0; c < 3; c++) {
+                if(wide) {
+                    uint16_t v = (rgb[c] << 6) | (rgb[c] >> 4);
+                    row[6 * x + 2 * c + 0] = v >> 8;
+                    row[6 * x + 2 * c + 1] = v & 0xff;
+                } else {
+                    row[3 * x + c] = rgb[c];
+                }
+            }
+        }
+        raw.push_back(1);
+        for(uint32_t i = 0; i < row.size(); i++) {
+            uint8_t left = (i >= bytes_per_pixel) ? row[i - bytes_per_pixel] : 0;
+            raw.push_back(row[i] - left);
+        }
+    }
+
+    std::vector<uint8_t> header;
+    put_be32(header, width);
+    put_be32(header, height);
+    header.insert(header.end(), {uint8_t(wide ? 16 : 8), 2, 0, 0, 0});     // RGB, no interlace
+
+    static const uint8_t signature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    std::vector<uint8_t> out(signature, signature + sizeof(signature));
+    put_png_chunk(out, "IHDR", header);
+    put_png_chunk(out, "IDAT", png_deflate(raw));
+    put_png_chunk(out, "IEND", {});
+
+    FILE *fp = fopen(filename.c_str(), "wb");
+    if(!fp) {
+        std::cerr << "couldn't open " << filename << " for writing\n";
+        return;
+    }
+    fwrite(out.data(), 1, out.size(), fp);
+    fclose(fp);
+}
+
+uint16_t float_to_half(float f)
+{
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000;
+    int32_t exponent = ((bits >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = bits & 0x7fffff;
+
+    if(((bits >> 23) & 0xff) == 0xff) {
+        return sign | 0x7c00 | (mantissa ? 0x200 : 0);     // inf or nan
+    }
+    if(exponent >= 31) {
+        return sign | 0x7c00;
+    }
+    if(exponent <= 0) {
+        if(exponent < -10) {
+            return sign;
+        }
+        mantissa |= 0x800000;
+        uint32_t shift = 14 - exponent;
+        return sign | ((mantissa + (1 << (shift - 1))) >> shift);
+    }
+    // Rounding may carry into the exponent, which is still correct
+    return (sign | (exponent << 10) | (mantissa >> 13)) + ((mantissa >> 12) & 1);
+}
+
+template <typename T>
+void put_le(std::vector<uint8_t>& out, T v)
+{
+    uint8_t bytes[sizeof(T)];
+    memcpy(bytes, &v, sizeof(T));
+    out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+void put_exr_attribute(std::vector<uint8_t>& out, const char *name, const char *type, const std::vector<uint8_t>& value)
+{
+    out.insert(out.end(), name, name + strlen(name) + 1);
+    out.insert(out.end(), type, type + strlen(type) + 1);
+    put_le<int32_t>(out, value.size());
+    out.insert(out.end(), value.begin(), value.end());
+}
+
+// Uncompressed scanline OpenEXR of the accumulated mean: sums holds
+// RGBA per-pixel sums and counts the samples behind them
+void write_exr(const std::string& filename, const float *sums, const uint32_t *counts, uint32_t width, uint32_t height, bool half)
+{
+    const int32_t pixel_type = half ? 1 : 2;
+    const uint32_t channel_size = half ? 2 : 4;
+
+    std::vector<uint8_t> out;
+    put_le<uint32_t>(out, 20000630);
+    put_le<uint32_t>(out, 2);
+
+    // Channels must be listed in alphabetical order
+    std::vector<uint8_t> channels;
+    for(const char *name : {"B", "G", "R"}) {
+        channels.insert(channels.end(), name, name + 2);
+        put_le<int32_t>(channels, pixel_type);
+        channels.insert(channels.end(), {0, 0, 0, 0});
+        put_le<int32_t>(channels, 1);
+        put_le<int32_t>(channels, 1);
+    }
+    channels.push_back(0);
+    put_exr_attribute(out, "channels", "chlist", channels);
+    put_exr_attribute(out, "compression", "compression", {0});
+
+    std::vector<uint8_t> window;
+    put_le<int32_t>(window, 0);
+    put_le<int32_t>(window, 0);
+    put_le<int32_t>(window, width - 1);
+    put_le<int32_t>(window, height - 1);
+    put_exr_attribute(out, "dataWindow", "box2i", window);
+    put_exr_attribute(out, "displayWindow", "box2i", window);
+    put_exr_attribute(out, "lineOrder", "lineOrder", {0});
+
+    std::vector<uint8_t> value;
+    put_le<float>(value, 1.0f);
+    put_exr_attribute(out, "pixelAspectRatio", "float", value);
+    put_exr_attribute(out, "screenWindowWidth", "float", value);
+    value.clear();
+    put_le<float>(value, 0.0f);
+    put_le<float>(value, 0.0f);
+    put_exr_attribute(out, "screenWindowCenter", "v2f", value);
+    out.push_back(0);
+
+    // One scanline per block, each block y, size, then B, G and R planes
+    uint64_t block_size = 8 + 3 * channel_size * width;
+    uint64_t first_block = out.size() + 8 * height;
+    for(uint32_t y = 0; y < height; y++) {
+        put_le<uint64_t>(out, first_block + y * block_size);
+    }
+    for(uint32_t y = 0; y < height; y++) {
+        put_le<int32_t>(out, y);
+        put_le<int32_t>(out, 3 * channel_size * width);
+        for(int c = 2; c >= 0; c--) {
+            for(uint32_t x = 0; x < width; x++) {
+                uint32_t n = std::max(1u, counts[y * width + x]);
+                float mean = sums[4 * (y * width + x) + c] / n;
+                if(half) {
+                    put_le<uint16_t>(out, float_to_half(mean));
+                } else {
+                    put_le<float>(out, mean);
+                }
+            }
+        }
+    }
+
+    FILE *fp = fopen(filename.c_str(), "wb");
+    if(!fp) {
+        std::cerr << "couldn't open " << filename << " for writing\n";
+        return;
+    }
+    fwrite(out.data(), 1, out.size(), fp);
+    fclose(fp);
+}
+
+// Runs on the encoder pool
+void encode_readback(int index)
+{
+    readback_slot& slot = readback_slots[index];
+    wait_for_gpu(slot.copied);
+    VkMappedMemoryRange range = { VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE, nullptr, slot.staging.mem, 0, VK_WHOLE_SIZE };
+    VK_CHECK(vkd.InvalidateMappedMemoryRanges(device, 1, &range));
+
+    auto started = std::chrono::steady_clock::now();
+    switch(slot.encoding) {
+        case ENCODING_PPM:
+            write_ppm(slot.filename, slot.pixels, slot.width, slot.height, slot.format);
+            break;
+        case ENCODING_PNG:
+            write_png(slot.filename, slot.pixels, slot.width, slot.height, slot.format);
+            break;
+        case ENCODING_EXR_HALF:
+        case ENCODING_EXR_FLOAT: {
+            const float *sums = (const float*)slot.pixels;
+            const uint32_t *counts = (const uint32_t*)(slot.pixels + 4 * sizeof(float) * slot.width * slot.height);
+            write_exr(slot.filename, sums, counts, slot.width, slot.height, slot.encoding == ENCODING_EXR_HALF);
+            break;
+        }
+    }
+    if(be_noisy) {
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+        std::cout << "saved " << slot.filename << " in " << elapsed.count() << " ms\n";
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(readback_mutex);
+        slot.busy = false;
+    }
+    readback_changed.notify_all();
+}
+
+void create_readback_ring()
+{
+    VkMemoryPropertyFlags properties = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT;
+    if(!has_memory_type(properties)) {
+        properties = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    }
+
+    // Big enough for the HDR sums plus sample counts
+    VkDeviceSize size = (4 * sizeof(float) + sizeof(uint32_t)) * image_width * image_height;
+    for(auto& slot : readback_slots) {
+        create_buffer(size, VK_BUFFER_USAGE_TRANSFER_DST_BIT, properties, &slot.staging);
+        VK_CHECK(vkd.MapMemory(device, slot.staging.mem, 0, size, 0, (void**)&slot.pixels));
+    }
+
+    unsigned int encoder_count = std::max(1u, std::min<unsigned int>(readback_slot_count, std::thread::hardware_concurrency() / 2));
+    encoders.reset(new thread_pool(encoder_count, readback_slot_count));
+}
+
+// Writes out everything still queued before returning
+void destroy_readback_ring()
+{
+    encoders.reset();
+
+    for(auto& slot : readback_slots) {
+        if(slot.commands != VK_NULL_HANDLE) {
+            vkd.FreeCommandBuffers(device, thread_command_pool(), 1, &slot.commands);
+            slot.commands = VK_NULL_HANDLE;
+        }
+        vkd.UnmapMemory(device, slot.staging.mem);
+        destroy_buffer(slot.staging);
+    }
+}
+
+// Block until every queued frame has been written
+void wait_for_readbacks()
+{
+    std::unique_lock<std::mutex> lock(readback_mutex);
+    readback_changed.wait(lock, []() {
+        for(auto& slot : readback_slots) {
+            if(slot.busy) {
+                return false;
+            }
+        }
+        return true;
+    });
+}
+
+// Queue a copy of the output image (or, for EXR, the accumulated HDR
+// sums) and return; the file is encoded in the background once the copy
+// completes
+void screenshot(const std::string& filename)
+{
+    int index = next_readback_slot;
+    next_readback_slot = (next_readback_slot + 1) % readback_slot_count;
+    readback_slot& slot = readback_slots[index];
+
+    {
+        std::unique_lock<std::mutex> lock(readback_mutex);
+        readback_changed.wait(lock, [&]{ return !slot.busy; });
+    }
+
+    if(slot.commands != VK_NULL_HANDLE) {
+        vkd.FreeCommandBuffers(device, thread_command_pool(), 1, &slot.commands);
+    }
+    slot.commands = getCommandBuffer(true);
+    slot.filename = filename;
+    slot.encoding = encoding_for_filename(filename);
+    slot.format = output_format;
+    slot.width = region.width;
+    slot.height = region.height;
+
+    bool hdr = slot.encoding == ENCODING_EXR_HALF || slot.encoding == ENCODING_EXR_FLOAT;
+    begin_pass(slot.commands, {
+        { hdr ? RESOURCE_ACCUMULATION : RESOURCE_OUTPUT_IMAGE, VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_READ_BIT, false },
+        { RESOURCE_READBACK, VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, true },
+    });
+    VkBufferImageCopy copy = {};
+    copy.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+    copy.imageExtent = { region.width, region.height, 1 };
+    if(hdr) {
+        vkd.CmdCopyImageToBuffer(slot.commands, accumulation_image.img, VK_IMAGE_LAYOUT_GENERAL, slot.staging.buf, 1, &copy);
+        copy.bufferOffset = 4 * sizeof(float) * region.width * region.height;
+        vkd.CmdCopyImageToBuffer(slot.commands, sample_count_image.img, VK_IMAGE_LAYOUT_GENERAL, slot.staging.buf, 1, &copy);
+    } else {
+        vkd.CmdCopyImageToBuffer(slot.commands, output_image.img, VK_IMAGE_LAYOUT_GENERAL, slot.staging.buf, 1, &copy);
+    }
+    begin_pass(slot.commands, {{ RESOURCE_READBACK, VK_PIPELINE_STAGE_2_HOST_BIT, VK_ACCESS_2_HOST_READ_BIT, false }});
+    VK_CHECK(vkd.EndCommandBuffer(slot.commands));
+
+    slot.copied = submit_commands(1, &slot.commands);
+
+    {
+        std::unique_lock<std::mutex> lock(readback_mutex);
+        slot.busy = true;
+    }
+    encoders->submit([index]() { encode_readback(index); });
+}
+
+void init_vulkan()
+{
+    if(be_noisy) {
+        print_implementation_information();
+    }
+    create_instance(&instance);
+    end_startup_phase("instance");
+    // get physical device surface support functions
+    // get swapchain functions
+    choose_physical_device(instance, &physical_device);
+    memory_properties = capabilities.memory;
+    choose_direct_write_memory();
+    ray_tracing_pipeline_properties = capabilities.ray_tracing_pipeline;
+    acceleration_structure_properties = capabilities.acceleration_structure;
+    end_startup_phase("choose device");
+
+    for(int i = 0; i < capabilities.queue_families.size(); i++) {
+        if(capabilities.queue_families[i].queueFlags & VK_QUEUE_GRAPHICS_BIT) {
+                preferred_queue_family = i;
+        }
+    }
+
+    if(preferred_queue_family == NO_QUEUE_FAMILY) {
+        std::cerr << "no desired queue family was found\n";
+	exit(EXIT_FAILURE);
+    }
+
+    if(be_noisy) {
+        print_device_information(capabilities);
+    }
+    create_device(physical_device, &device);
+    end_startup_phase("device");
+
+    workers.reset(new thread_pool(std::max(1u, std::thread::hardware_concurrency())));
+    end_startup_phase("workers");
+}
+
+void prepare_vulkan()
+{
+    // Pipeline compilation runs on the worker threads while the scene is
+    // uploaded and built on this one
+    create_descriptor_set_layout();
+    create_pipeline_cache();
+    work_list_pipeline = create_compute_pipeline("worklist.comp");
+    tonemap_pipeline = create_compute_pipeline("tonemap.comp");
+    end_startup_phase("compute pipelines");
+    add_material("vertex_color", MATERIAL_VERTEX_COLOR);
+    add_material("checker", MATERIAL_VERTEX_COLOR | MATERIAL_CHECKER);
+    add_material("leaf", MATERIAL_VERTEX_COLOR | MATERIAL_CUTOUT);
+    request_variant(variant_for_settings());
+
+    create_scene();
+    end_startup_phase("scene");
+    choose_output_format();
+    create_image(image_width, image_height, output_format, VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, &output_image);
+    create_accumulation_targets();
+    update_descriptor_set();
+    create_readback_ring();
+    end_startup_phase("render targets");
+
+    // create swapchain
+
+    choose_pipeline();
+    end_startup_phase("pipeline");
+}
+
+void cleanup_vulkan()
+{
+    stop_streaming();
+    drain_lod_uploads();
+    vkd.DeviceWaitIdle(device);
+
+    destroy_readback_ring();
+    destroy_pipelines();
+    vkd.DestroyPipeline(device, work_list_pipeline, nullptr);
+    vkd.DestroyPipeline(device, tonemap_pipeline, nullptr);
+    workers.reset();
+
+    destroy_shader_modules();
+    save_pipeline_cache();
+    vkd.DestroyPipelineCache(device, pipeline_cache, nullptr);
+    vkd.DestroyPipelineLayout(device, pipeline_layout, nullptr);
+    vkd.DestroyPipelineLayout(device, compute_pipeline_layout, nullptr);
+    vkd.DestroyDescriptorPool(device, descriptor_pool, nullptr);
+    vkd.DestroyDescriptorSetLayout(device, descriptor_set_layout, nullptr);
+
+    destroy_accumulation_targets();
+    destroy_image(output_image);
+    destroy_buffer(mesh_table);
+    destroy_acceleration_structure(tlas);
+    if(instance_buffer_mapped) {
+        vkd.UnmapMemory(device, instance_buffer.mem);
+        destroy_buffer(instance_buffer);
+        instance_buffer_mapped = nullptr;
+    }
+    for(auto& m : meshes) {
+        release_mesh(m);
+    }
+    meshes.clear();
+    instances.clear();
+    instance_meshes.clear();
+    instance_lods.clear();
+    for(VkCommandPool pool : command_pools) {
+        vkd.DestroyCommandPool(device, pool, nullptr);
+    }
+    command_pools.clear();
+    vkd.DestroySemaphore(device, gpu_timeline, nullptr);
+
+#if 0
+    VkDestroyPipeline(device, pipeline, nullptr);
+    VkDestroyPipelineLayout(device, pipeline_layout, nullptr);
+    VkDestroyDescriptorSetLayout(device, descriptor_set_layout, nullptr);
+
+    VkDestroyBuffer(device, vertex_buffer, nullptr);
+    VkFreeMemory(device, vertex_memory, nullptr);
+
+    VkDestroyBuffer(device, index_buffer, nullptr);
+    VkFreeMemory(device, index_memory, nullptr);
+
+    VkDestroyBuffer(device, vs_uniform_block_buffer, nullptr);
+    VkFreeMemory(device, vs_uniform_block_memory, nullptr);
+
+    VkDestroySemaphore(device, present_complete, nullptr);
+    VkDestroySemaphore(device, render_complete, nullptr);
+
+    for(auto& f : wait_fences)
+	VkDestroyFence(device, f, nullptr);
+#endif
+}
+
+static void error_callback(int error, const char* description)
+{
+    fprintf(stderr, "GLFW: %s\n", description);
+}
+
+bool quit = false;
+
+void key_callback(GLFWwindow *window, int key, int scancode, int action, int mods)
+{
+    if(action == GLFW_PRESS) {
+        switch(key) {
+            case 'Q': case '\033':
+                glfwSetWindowShouldClose(window, GL_TRUE);
+                break;
+
+            case 'S':
+                screenshot("color.ppm");
+                break;
+
+            case 'B':
+                settings.max_bounces = (settings.max_bounces >= 8) ? 1 : settings.max_bounces * 2;
+                std::cout << "max bounces " << settings.max_bounces << "\n";
+                break;
+
+            case 'N':
+                settings.samples_per_pixel = (settings.samples_per_pixel >= 16) ? 1 : settings.samples_per_pixel * 2;
+                std::cout << "samples per pixel " << settings.samples_per_pixel << "\n";
+                break;
+
+            case 'T':
+                settings.tone_operator = (settings.tone_operator + 1) % TONEMAP_OPERATOR_COUNT;
+                tonemap_needed = true;
+                std::cout << "tone operator " << tone_operator_names[settings.tone_operator] << "\n";
+                break;
+
+            case '=': case '-':
+                settings.exposure += (key == '=') ? 0.5f : -0.5f;
+                tonemap_needed = true;
+                std::cout << "exposure " << settings.exposure << " stops\n";
+                break;
+
+            case 'V':
+                settings.adaptive_sampling = !settings.adaptive_sampling;
+                std::cout << "adaptive sampling " << (settings.adaptive_sampling ? "on" : "off") << "\n";
+                break;
+
+            case 'A':
+                settings.any_hit_enabled = !settings.any_hit_enabled;
+                std::cout << "any-hit " << (settings.any_hit_enabled ? "on" : "off") << "\n";
+                break;
+        }
+    }
+}
+
+// Resolve the accumulated mean into the output image with the current
+// exposure and operator; ordered after this frame's raygen writes
+void record_tonemap(VkCommandBuffer commands)
+{
+    begin_pass(commands, {
+        { RESOURCE_ACCUMULATION, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_READ_BIT, false },
+        { RESOURCE_OUTPUT_IMAGE, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_WRITE_BIT, true },
+    });
+
+    tonemap_constants constants = { powf(2.0f, settings.exposure), settings.tone_operator, {region.width, region.height} };
+    vkd.CmdBindPipeline(commands, VK_PIPELINE_BIND_POINT_COMPUTE, tonemap_pipeline);
+    vkd.CmdBindDescriptorSets(commands, VK_PIPELINE_BIND_POINT_COMPUTE, compute_pipeline_layout, 0, 1, &descriptor_set, 0, nullptr);
+    vkd.CmdPushConstants(commands, compute_pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants), &constants);
+    vkd.CmdDispatch(commands, (region.width + 7) / 8, (region.height + 7) / 8, 1);
+
+    tonemap_needed = false;
+}
+
+// Returns whether a frame was traced
+bool draw_frame(void)
+{
+    choose_pipeline();
+
+    if(accumulation.converged) {
+        if(tonemap_needed) {
+            VkCommandBuffer commands = getCommandBuffer(true);
+            record_tonemap(commands);
+            flushCommandBuffer(commands);
+        }
+        return false;
+    }
+
+    // Until min_frames are in, the variance estimate isn't trusted and every pixel is traced
+    bool adaptive = settings.adaptive_sampling && (accumulation.frame_count >= settings.min_frames);
+
+    frame_constants constants;
+    constants.camera = camera;
+    constants.frame_index = accumulation.frame_count;
+    constants.adaptive = adaptive ? 1 : 0;
+    constants.region_offset[0] = region.x;
+    constants.region_offset[1] = region.y;
+    constants.region_extent[0] = region.width;
+    constants.region_extent[1] = region.height;
+    constants.frame_size[0] = frame_width;
+    constants.frame_size[1] = frame_height;
+
+    VkCommandBuffer commands = getCommandBuffer(true);
+
+    buffer scene_scratch = {}, scene_staging = {};
+    if(scene_update_pending) {
+        record_tlas_build(commands, &scene_scratch);
+        record_mesh_table(commands, &scene_staging);
+        update_descriptor_set();
+        scene_update_pending = false;
+    }
+
+    // raygen folds each pixel's error into its tile with atomicMax, and
+    // worklist.comp counts entries into the indirect command's width
+    const VkAccessFlags2KHR atomics = VK_ACCESS_2_SHADER_READ_BIT | VK_ACCESS_2_SHADER_WRITE_BIT;
+    std::vector<resource_use> clears = {{ RESOURCE_TILE_ERRORS, VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, true }};
+    if(adaptive) {
+        clears.push_back({ RESOURCE_WORK_LIST, VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, true });
+    }
+    begin_pass(commands, clears);
+    vkd.CmdFillBuffer(commands, tile_errors.buf, 0, VK_WHOLE_SIZE, 0);
+    if(adaptive) {
+        work_list_header header = { {0, 1, 1}, 0 };
+        vkd.CmdUpdateBuffer(commands, work_list.buf, 0, sizeof(header), &header);
+    }
+
+    if(adaptive) {
+        begin_pass(commands, {
+            { RESOURCE_ACCUMULATION, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_READ_BIT, false },
+            { RESOURCE_WORK_LIST, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, atomics, true },
+        });
+        work_list_constants list_constants = { settings.target_error, settings.max_adaptive_samples, {region.width, region.height} };
+        vkd.CmdBindPipeline(commands, VK_PIPELINE_BIND_POINT_COMPUTE, work_list_pipeline);
+        vkd.CmdBindDescriptorSets(commands, VK_PIPELINE_BIND_POINT_COMPUTE, compute_pipeline_layout, 0, 1, &descriptor_set, 0, nullptr);
+        vkd.CmdPushConstants(commands, compute_pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(list_constants), &list_constants);
+        vkd.CmdDispatch(commands, (region.width + 7) / 8, (region.height + 7) / 8, 1);
+    }
+
+    std::vector<resource_use> trace = {
+        { RESOURCE_TILE_ERRORS, VK_PIPELINE_STAGE_2_RAY_TRACING_SHADER_BIT_KHR, atomics, true },
+        { RESOURCE_ACCUMULATION, VK_PIPELINE_STAGE_2_RAY_TRACING_SHADER_BIT_KHR, VK_ACCESS_2_SHADER_READ_BIT | VK_ACCESS_2_SHADER_WRITE_BIT, true },
+        { RESOURCE_TLAS, VK_PIPELINE_STAGE_2_RAY_TRACING_SHADER_BIT_KHR, VK_ACCESS_2_ACCELERATION_STRUCTURE_READ_BIT_KHR, false },
+        { RESOURCE_MESH_TABLE, VK_PIPELINE_STAGE_2_RAY_TRACING_SHADER_BIT_KHR, VK_ACCESS_2_SHADER_READ_BIT, false },
+    };
+    if(adaptive) {
+        trace.push_back({ RESOURCE_WORK_LIST, VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_2_RAY_TRACING_SHADER_BIT_KHR, VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_2_SHADER_READ_BIT, false });
+    }
+    begin_pass(commands, trace);
+
+    vkd.CmdBindPipeline(commands, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, current_pipeline->pipeline);
+    vkd.CmdBindDescriptorSets(commands, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, pipeline_layout, 0, 1, &descriptor_set, 0, nullptr);
+    vkd.CmdPushConstants(commands, pipeline_layout, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 0, sizeof(constants), &constants);
+
+    if(adaptive) {
+        vkd.CmdTraceRaysIndirectKHR(commands, &current_pipeline->raygen_region, &current_pipeline->miss_region, &current_pipeline->hit_region, &current_pipeline->callable_region, get_buffer_device_address(work_list));
+    } else {
+        vkd.CmdTraceRaysKHR(commands, &current_pipeline->raygen_region, &current_pipeline->miss_region, &current_pipeline->hit_region, &current_pipeline->callable_region, region.width, region.height, 1);
+    }
+
+    // update_convergence reads the tile errors once the frame is done
+    begin_pass(commands, {{ RESOURCE_TILE_ERRORS, VK_PIPELINE_STAGE_2_HOST_BIT, VK_ACCESS_2_HOST_READ_BIT, false }});
+
+    record_tonemap(commands);
+
+    flushCommandBuffer(commands);
+    destroy_buffer(scene_scratch);
+    destroy_buffer(scene_staging);
+
+    if(print_barrier_stats) {
+        printf("frame %u: %u barriers issued, %u elided\n", accumulation.frame_count, barriers_issued, barriers_elided);
+    }
+    barriers_issued = 0;
+    barriers_elided = 0;
+
+    accumulation.frame_count++;
+    update_convergence();
+
+    // copy to present
+
+    return true;
+}
+
+// Render the whole frame one region at a time, accumulating each to
+// convergence and writing it straight into its place in a binary PPM, so
+// neither GPU nor host memory grows with the frame size
+uint32_t tiled_region_count()
+{
+    uint32_t regions_x = (frame_width + image_width - 1) / image_width;
+    uint32_t regions_y = (frame_height + image_height - 1) / image_height;
+    return regions_x * regions_y;
+}
+
+void set_tiled_region(uint32_t index)
+{
+    uint32_t regions_x = (frame_width + image_width - 1) / image_width;
+    region.x = (index % regions_x) * image_width;
+    region.y = (index / regions_x) * image_height;
+    region.width = std::min(image_width, frame_width - region.x);
+    region.height = std::min(image_height, frame_height - region.y);
+}
+
+// Trace regions until next_region runs past the end of the frame, writing
+// each into its place in the PPM; the counter may be shared with other
+// processes, so whoever finishes a region first takes the next one
+uint32_t render_tiled_regions(FILE *fp, long header_size, std::atomic<uint32_t>& next_region)
+{
+    uint32_t bytes_per_pixel = ppm_bytes_per_pixel(output_format);
+    uint32_t region_count = tiled_region_count();
+    uint32_t rendered = 0;
+    wait_for_streaming();
+
+    buffer readback;
+    VkDeviceSize readback_size = sizeof(uint32_t) * image_width * image_height;
+    create_buffer(readback_size, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &readback);
+    uint8_t *pixels;
+    VK_CHECK(vkd.MapMemory(device, readback.mem, 0, readback_size, 0, (void**)&pixels));
+
+    std::vector<uint8_t> row(bytes_per_pixel * image_width);
+
+    for(uint32_t index = next_region++; index < region_count; index = next_region++) {
+        set_tiled_region(index);
+
+        reset_accumulation();
+        while(!accumulation.converged) {
+            draw_frame();
+        }
+
+        VkCommandBuffer commands = getCommandBuffer(true);
+        begin_pass(commands, {
+            { RESOURCE_OUTPUT_IMAGE, VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_READ_BIT, false },
+            { RESOURCE_READBACK, VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, true },
+        });
+        VkBufferImageCopy copy = {};
+        copy.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+        copy.imageExtent = { region.width, region.height, 1 };
+        vkd.CmdCopyImageToBuffer(commands, output_image.img, VK_IMAGE_LAYOUT_GENERAL, readback.buf, 1, &copy);
+        begin_pass(commands, {{ RESOURCE_READBACK, VK_PIPELINE_STAGE_2_HOST_BIT, VK_ACCESS_2_HOST_READ_BIT, false }});
+        flushCommandBuffer(commands);
+
+        for(uint32_t y = 0; y < region.height; y++) {
+            convert_ppm_row(pixels + 4 * region.width * y, region.width, output_format, row.data());
+            long offset = header_size + bytes_per_pixel * ((long)(region.y + y) * frame_width + region.x);
+            fseek(fp, offset, SEEK_SET);
+            fwrite(row.data(), bytes_per_pixel, region.width, fp);
+        }
+        fflush(fp);
+        rendered++;
+
+        if(be_noisy) {
+            std::cout << "region " << (index + 1) << " of " << region_count << " written\n";
+        }
+    }
+
+    vkd.UnmapMemory(device, readback.mem);
+    destroy_buffer(readback);
+    return rendered;
+}
+
+void render_tiled(const char *filename)
+{
+    FILE *fp = fopen(filename, "wb");
+    if(!fp) {
+        std::cerr << "couldn't open " << filename << " for writing\n";
+        exit(EXIT_FAILURE);
+    }
+    write_ppm_header(fp, frame_width, frame_height, output_format);
+    long header_size = ftell(fp);
+    auto started = std::chrono::steady_clock::now();
+
+    std::atomic<uint32_t> next_region(0);
+    render_tiled_regions(fp, header_size, next_region);
+    fclose(fp);
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+    std::cout << "wrote " << frame_width << "x" << frame_height << " frame to " << filename << " in " << elapsed.count() << " ms\n";
+}
+
+#ifndef _WIN32
+// DEVICES=0,1,2,3 renders a tiled frame with one process per listed
+// device (each entry is anything VKRT_DEVICE accepts, e.g. index:2).  Every process has
+// its own VkDevice, scene and acceleration structures; they take regions
+// from a counter in shared memory and write them straight into the one
+// output file, so faster devices simply end up rendering more regions.
+int render_tiled_multi_device(const char *filename, const std::vector<std::string>& selectors)
+{
+    // The header is written before any device exists, so every device has
+    // to produce the format asked for; a child that can't says so and fails
+    VkFormat expected_format = (settings.output_bits == 10) ? VK_FORMAT_A2B10G10R10_UNORM_PACK32 : VK_FORMAT_R8G8B8A8_UNORM;
+    FILE *fp = fopen(filename, "wb");
+    if(!fp) {
+        std::cerr << "couldn't open " << filename << " for writing\n";
+        return EXIT_FAILURE;
+    }
+    write_ppm_header(fp, frame_width, frame_height, expected_format);
+    long header_size = ftell(fp);
+    fclose(fp);
+
+    void *shared = mmap(nullptr, sizeof(std::atomic<uint32_t>), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(shared == MAP_FAILED) {
+        std::cerr << "couldn't map memory shared with device processes\n";
+        return EXIT_FAILURE;
+    }
+    std::atomic<uint32_t> *next_region = new(shared) std::atomic<uint32_t>(0);
+    auto started = std::chrono::steady_clock::now();
+
+    std::vector<pid_t> children;
+    for(const std::string& selector : selectors) {
+        // Children exit through VK_CHECK's exit() too, which would flush a
+        // copy of anything the parent still had buffered
+        std::cout.flush();
+        fflush(nullptr);
+        pid_t pid = fork();
+        if(pid < 0) {
+            std::cerr << "couldn't start a process for device " << selector << "\n";
+            break;
+        }
+        if(pid == 0) {
+            // Nothing Vulkan exists yet in the parent, so the child starts
+            // from a clean slate
+            setenv("VKRT_DEVICE", selector.c_str(), 1);
+            init_vulkan();
+            prepare_vulkan();
+            if(output_format != expected_format) {
+                std::cerr << "device " << selector << " can't write the requested output format\n";
+                _exit(EXIT_FAILURE);
+            }
+            FILE *child_fp = fopen(filename, "r+b");
+            if(!child_fp) {
+                std::cerr << "couldn't open " << filename << " for writing\n";
+                _exit(EXIT_FAILURE);
+            }
+            auto device_started = std::chrono::steady_clock::now();
+            uint32_t rendered = render_tiled_regions(child_fp, header_size, *next_region);
+            fclose(child_fp);
+            auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - device_started);
+            std::cout << "device " << selector << ": " << rendered << " regions in " << elapsed.count() << " ms\n";
+            cleanup_vulkan();
+            fflush(stdout);
+            _exit(EXIT_SUCCESS);
+        }
+        children.push_back(pid);
+    }
+
+    bool failed = children.size() != selectors.size();
+    for(pid_t pid : children) {
+        int status;
+        if(waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+            failed = true;
+        }
+    }
+    munmap(shared, sizeof(std::atomic<uint32_t>));
+
+    // Regions taken by a process that died are never written
+    if(failed) {
+        std::cerr << "a device process failed; " << filename << " is incomplete\n";
+        return EXIT_FAILURE;
+    }
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+    std::cout << "wrote " << frame_width << "x" << frame_height << " frame to " << filename << " on " << selectors.size() << " devices in " << elapsed.count() << " ms\n";
+    return EXIT_SUCCESS;
+}
+#endif
+
+// Just enough JSON for job descriptions
+struct json_value {
+    enum kind_t { NUL, BOOLEAN, NUMBER, STRING, ARRAY, OBJECT } kind = NUL;
+    bool boolean = false;
+    double number = 0;
+    std::string string;
+    std::vector<json_value> array;
+    std::map<std::string, json_value> object;
+
+    const json_value* find(const std::string& key) const
+    {
+        auto found = object.find(key);
+        return (found == object.end()) ? nullptr : &found->second;
+    }
+};
+
+struct json_parser {
+    const std::string& text;
+    size_t at = 0;
+    int depth = 0;          // objects and arrays currently open
+    std::string error;
+
+    // Nesting is parsed recursively, so it's bounded well short of the stack
+    static const int max_depth = 64;
+
+    json_parser(const std::string& text) : text(text) {}
+
+    void skip_space()
+    {
+        while(at < text.size() && isspace((unsigned char)text[at]))
+            at++;
+    }
+
+    bool fail(const std::string& what)
+    {
+        if(error.empty())
+            error = what + " at offset " + std::to_string(at);
+        return false;
+    }
+
+    bool expect(char c)
+    {
+        skip_space();
+        if(at >= text.size() || text[at] != c)
+            return fail(std::string("expected '") + c + "'");
+        at++;
+        return true;
+    }
+
+    bool parse_string(std::string& out)
+    {
+        if(!expect('"'))
+            return false;
+        while(at < text.size() && text[at] != '"') {
+            char c = text[at++];
+            if(c == '\\' && at < text.size()) {
+                char e = text[at++];
+                switch(e) {
+                    case 'n': c = '\n'; break;
+                    case 't': c = '\t'; break;
+                    case 'r': c = '\r'; break;
+                    case 'b': c = '\b'; break;
+                    case 'f': c = '\f'; break;
+                    case 'u':
+                        // Only ASCII escapes are meaningful in job files
+                        c = (at + 4 <= text.size()) ? (char)strtol(text.substr(at, 4).c_str(), nullptr, 16) : '?';
+                        at += 4;
+                        break;
+                    default: c = e; break;
+                }
+            }
+            out.push_back(c);
+        }
+        return expect('"');
+    }
+
+    bool parse_object(json_value& out)
+    {
+        out.kind = json_value::OBJECT;
+        at++;
+        skip_space();
+        if(at < text.size() && text[at] == '}') {
+            at++;
+            return true;
+        }
+        do {
+            std::string key;
+            skip_space();
+            if(!parse_string(key) || !expect(':') || !parse(out.object[key]))
+                return false;
+            skip_space();
+        } while(at < text.size() && text[at] == ',' && ++at);
+        return expect('}');
+    }
+
+    bool parse_array(json_value& out)
+    {
+        out.kind = json_value::ARRAY;
+        at++;
+        skip_space();
+        if(at < text.size() && text[at] == ']') {
+            at++;
+            return true;
+        }
+        do {
+            out.array.emplace_back();
+            if(!parse(out.array.back()))
+                return false;
+            skip_space();
+        } while(at < text.size() && text[at] == ',' && ++at);
+        return expect(']');
+    }
+
+    bool parse(json_value& out)
+    {
+        skip_space();
+        if(at >= text.size())
+            return fail("unexpected end");
+
+        char c = text[at];
+        if(c == '{' || c == '[') {
+            if(depth == max_depth)
+                return fail("nested more than " + std::to_string(max_depth) + " deep");
+            depth++;
+            bool parsed = (c == '{') ? parse_object(out) : parse_array(out);
+            depth--;
+            return parsed;
+        }
+        if(c == '"') {
+            out.kind = json_value::STRING;
+            return parse_string(out.string);
+        }
+        if(text.compare(at, 4, "true") == 0 || text.compare(at, 5, "false") == 0) {
+            out.kind = json_value::BOOLEAN;
+            out.boolean = (c == 't');
+            at += out.boolean ? 4 : 5;
+            return true;
+        }
+        if(text.compare(at, 4, "null") == 0) {
+            at += 4;
+            return true;
+        }
+
+        char *end;
+        out.kind = json_value::NUMBER;
+        out.number = strtod(text.c_str() + at, &end);
+        if(end == text.c_str() + at)
+            return fail("unexpected character");
+        at = end - text.c_str();
+        return true;
+    }
+};
+
+bool parse_json(const std::string& text, json_value& out, std::string& error)
+{
+    json_parser parser(text);
+    if(!parser.parse(out)) {
+        error = parser.error;
+        return false;
+    }
+    parser.skip_space();
+    if(parser.at != text.size()) {
+        error = "trailing characters at offset " + std::to_string(parser.at);
+        return false;
+    }
+    return true;
+}
+
+// One frame to render; anything a job doesn't specify takes these defaults
+struct render_job {
+    std::string scene = "builtin";
+    float eye[3] = {0, 8, -50};
+    float at[3] = {0, 0, 0};
+    float fov = 45;
+    uint32_t width = 512;
+    uint32_t height = 512;
+    uint32_t samples_per_pixel = 1;
+    uint32_t max_bounces = 1;
+    float target_error;
+    uint32_t max_frames;
+    std::string output = "output.png";
+};
+
+// The settings from startup, before any job changed them; jobs that leave
+// out target_error or max_frames take them from here
+render_settings job_defaults;
+
+uint32_t max_region_size = 1024;    // largest GPU image side; bigger frames are tiled
+
+// {"scene": "model.obj", "camera": {"eye": [0, 2, -5], "at": [0, 0, 0], "fov": 45},
+//  "width": 1920, "height": 1080, "spp": 4, "bounces": 4, "output": "frame.png"}
+bool parse_job(const std::string& text, render_job& job, std::string& error)
+{
+    json_value root;
+    if(!parse_json(text, root, error)) {
+        return false;
+    }
+    if(root.kind != json_value::OBJECT) {
+        error = "a job must be a JSON object";
+        return false;
+    }
+
+    job.target_error = job_defaults.target_error;
+    job.max_frames = job_defaults.max_frames;
+
+    // Numbers are checked before conversion; the first bad one fails the job
+    bool valid = true;
+    auto get_float = [&](const json_value *parent, const char *key, float& value) {
+        const json_value *v = parent ? parent->find(key) : nullptr;
+        if(v && v->kind == json_value::NUMBER) {
+            if(!std::isfinite(v->number) || std::fabs(v->number) > FLT_MAX) {
+                if(valid) {
+                    error = std::string(key) + " must be a finite number";
+                }
+                valid = false;
+            } else {
+                value = v->number;
+            }
+        }
+    };
+    auto get_count = [&](const json_value *parent, const char *key, uint32_t& value) {
+        const json_value *v = parent ? parent->find(key) : nullptr;
+        if(v && v->kind == json_value::NUMBER) {
+            double n = v->number;
+            if(!std::isfinite(n) || n < 0 || n > UINT32_MAX || n != std::floor(n)) {
+                if(valid) {
+                    error = std::string(key) + " must be a whole number from 0 to " + std::to_string(UINT32_MAX);
+                }
+                valid = false;
+            } else {
+                value = (uint32_t)n;
+            }
+        }
+    };
+    auto get_vector = [&](const json_value *parent, const char *key, float value[3]) {
+        const json_value *v = parent ? parent->find(key) : nullptr;
+        if(!v) {
+            return;
+        }
+        if(v->kind != json_value::ARRAY || v->array.size() != 3) {
+            if(valid) {
+                error = std::string(key) + " must be an array of 3 numbers";
+            }
+            valid = false;
+            return;
+        }
+        for(int i = 0; i < 3; i++) {
+            const json_value& element = v->array[i];
+            if(element.kind != json_value::NUMBER || !std::isfinite(element.number) || std::fabs(element.number) > FLT_MAX) {
+                if(valid) {
+                    error = std::string(key) + " must hold finite numbers";
+                }
+                valid = false;
+            } else {
+                value[i] = element.number;
+            }
+        }
+    };
+
+    if(const json_value *scene = root.find("scene")) {
+        job.scene = scene->string;
+    }
+    if(const json_value *output = root.find("output")) {
+        job.output = output->string;
+    }
+    const json_value *camera = root.find("camera");
+    get_vector(camera, "eye", job.eye);
+    get_vector(camera, "at", job.at);
+    get_float(camera, "fov", job.fov);
+    get_count(&root, "width", job.width);
+    get_count(&root, "height", job.height);
+    get_count(&root, "spp", job.samples_per_pixel);
+    get_count(&root, "bounces", job.max_bounces);
+    get_float(&root, "target_error", job.target_error);
+    get_count(&root, "max_frames", job.max_frames);
+    if(!valid) {
+        return false;
+    }
+
+    if(job.width == 0 || job.height == 0 || job.samples_per_pixel == 0 || job.max_bounces == 0) {
+        error = "width, height, spp and bounces must be positive";
+        return false;
+    }
+
+    // set_camera divides by the view direction's length and by its length
+    // across the vertical, so neither may vanish
+    float forward[3] = { job.at[0] - job.eye[0], job.at[1] - job.eye[1], job.at[2] - job.eye[2] };
+    float length = sqrtf(forward[0] * forward[0] + forward[1] * forward[1] + forward[2] * forward[2]);
+    if(!(length > 0.0f) || !std::isfinite(length)) {
+        error = "camera eye and at must be different points";
+        return false;
+    }
+    if(sqrtf(forward[0] * forward[0] + forward[2] * forward[2]) <= length * 1e-6f) {
+        error = "camera can't look straight up or down";
+        return false;
+    }
+    if(!(job.fov > 0.0f && job.fov < 180.0f)) {
+        error = "fov must be between 0 and 180 degrees";
+        return false;
+    }
+    return true;
+}
+
+// The GPU images only follow the region size, so they are recreated only
+// when a job's frame needs a different one
+void resize_render_targets(uint32_t width, uint32_t height)
+{
+    frame_width = width;
+    frame_height = height;
+    uint32_t new_width = std::min(width, max_region_size);
+    uint32_t new_height = std::min(height, max_region_size);
+
+    if(new_width != image_width || new_height != image_height) {
+        VK_CHECK(vkd.DeviceWaitIdle(device));
+        destroy_readback_ring();
+        destroy_accumulation_targets();
+        destroy_image(output_image);
+
+        image_width = new_width;
+        image_height = new_height;
+        create_image(image_width, image_height, output_format, VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT, &output_image);
+        create_accumulation_targets();
+        create_readback_ring();
+    }
+    region = {0, 0, image_width, image_height};
+}
+
+// Render one job with whatever the previous jobs left loaded; only the
+// parts that differ (images, scene, pipeline variant) are rebuilt
+bool run_job(const render_job& job)
+{
+    auto started = std::chrono::steady_clock::now();
+
+    resize_render_targets(job.width, job.height);
+    if(job.scene != current_scene && !set_scene(job.scene)) {
+        return false;
+    }
+    update_descriptor_set();
+
+    settings.samples_per_pixel = job.samples_per_pixel;
+    settings.max_bounces = job.max_bounces;
+    settings.target_error = job.target_error;
+    settings.max_frames = job.max_frames;
+    choose_pipeline(true);
+
+    set_camera(job.eye, job.at, job.fov);
+    wait_for_streaming();
+    wait_for_lods();
+
+    if(job.width <= image_width && job.height <= image_height) {
+        while(!accumulation.converged) {
+            draw_frame();
+        }
+        screenshot(job.output);
+    } else {
+        if(encoding_for_filename(job.output) != ENCODING_PPM) {
+            std::cerr << "frames larger than REGION_SIZE are streamed as PPM; writing " << job.output << " as PPM\n";
+        }
+        render_tiled(job.output.c_str());
+    }
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+    std::cout << "job " << job.output << ": " << elapsed.count() << " ms\n";
+    return true;
+}
+
+// One JSON job per line; blank lines and lines starting with # are skipped
+int run_batch(const char *filename)
+{
+    job_defaults = settings;
+    std::ifstream jobs(filename);
+    if(!jobs) {
+        std::cerr << "couldn't open job file " << filename << "\n";
+        return EXIT_FAILURE;
+    }
+
+    int failures = 0;
+    int line_number = 0;
+    std::string text;
+    while(std::getline(jobs, text)) {
+        line_number++;
+        size_t first = text.find_first_not_of(" \t\r\n");
+        if(first == std::string::npos || text[first] == '#') {
+            continue;
+        }
+
+        render_job job;
+        std::string error;
+        if(!parse_job(text, job, error)) {
+            std::cerr << filename << ":" << line_number << ": " << error << "\n";
+            failures++;
+            continue;
+        }
+        if(!run_job(job)) {
+            failures++;
+        }
+    }
+
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#ifndef _WIN32
+
+// A long-lived render server on a Unix domain socket.  Each connection
+// sends one JSON job per line (see parse_job), plus an optional
+// "reply": "bytes" to get the encoded image back instead of its path.
+// Jobs from all connections are rendered in arrival order on the main
+// thread with everything from earlier jobs still loaded.  Each reply is
+// one JSON line, followed by the image when bytes were asked for.
+const size_t max_server_request = 1 << 20;     // longest job line accepted
+const int server_send_timeout = 30;             // seconds a client may leave a reply unread
+
+// Replies are queued and sent by each connection's own writer thread, so
+// a client that stops reading only holds up itself, never the renderer
+struct server_connection {
+    int fd;
+    std::atomic<bool> reading {true};     // until its reader thread returns
+
+    std::mutex write_mutex;
+    std::condition_variable write_ready;
+    std::deque<std::string> outgoing;
+    bool writing = false;       // the writer has a reply in hand
+    bool broken = false;        // a send failed or timed out; later replies are dropped
+    bool closing = false;
+    std::thread writer;
+
+    server_connection(int fd) : fd(fd)
+    {
+        timeval timeout = {server_send_timeout, 0};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        writer = std::thread([this]() { write_replies(); });
+    }
+
+    // Whatever was queued is still sent before the socket closes
+    ~server_connection()
+    {
+        {
+            std::lock_guard<std::mutex> lock(write_mutex);
+            closing = true;
+        }
+        write_ready.notify_one();
+        writer.join();
+        close(fd);
+    }
+
+    void queue_reply(std::string reply)
+    {
+        {
+            std::lock_guard<std::mutex> lock(write_mutex);
+            if(broken) {
+                return;
+            }
+            outgoing.push_back(std::move(reply));
+        }
+        write_ready.notify_one();
+    }
+
+    bool replies_sent()
+    {
+        std::lock_guard<std::mutex> lock(write_mutex);
+        return broken || (outgoing.empty() && !writing);
+    }
+
+    bool send_all(const void *data, size_t size)
+    {
+        const char *p = (const char*)data;
+        while(size > 0) {
+            ssize_t sent = send(fd, p, size, MSG_NOSIGNAL);
+            if(sent <= 0) {
+                return false;
+            }
+            p += sent;
+            size -= sent;
+        }
+        return true;
+    }
+
+    void write_replies()
+    {
+        std::unique_lock<std::mutex> lock(write_mutex);
+        for(;;) {
+            write_ready.wait(lock, [this]{ return closing || !outgoing.empty(); });
+            if(outgoing.empty()) {
+                return;
+            }
+            std::string reply = std::move(outgoing.front());
+            outgoing.pop_front();
+            writing = true;
+            lock.unlock();
+            bool sent = send_all(reply.data(), reply.size());
+            lock.lock();
+            writing = false;
+            if(!sent) {
+                broken = true;
+                outgoing.clear();
+            }
+        }
+    }
+};
+
+struct server_request {
+    std::shared_ptr<server_connection> connection;
+    std::string text;
+};
+
+std::deque<server_request> server_requests;
+std::mutex server_mutex;
+std::condition_variable server_request_available;
+std::atomic<bool> server_stopping {false};
+
+std::string json_escape(const std::string& s)
+{
+    std::string out;
+    for(char c : s) {
+        if(c == '"' || c == '\\') {
+            out.push_back('\\');
+            out.push_back(c);
+        } else if((unsigned char)c < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
+        } else {
+            out.push_back(c);
+        }
+    }
+    return out;
+}
+
+void server_reply_error(server_connection& connection, const std::string& message)
+{
+    connection.queue_reply("{\"status\": \"error\", \"message\": \"" + json_escape(message) + "\"}\n");
+}
+
+void server_read_requests(std::shared_ptr<server_connection> connection)
+{
+    std::string pending;
+    char buffer[4096];
+    for(;;) {
+        ssize_t received = recv(connection->fd, buffer, sizeof(buffer), 0);
+        if(received <= 0) {
+            connection->reading = false;
+            return;
+        }
+        pending.append(buffer, received);
+
+        for(;;) {
+            // Nothing after an overlong line can be trusted to start a new
+            // request, so the connection stops being read
+            size_t newline = pending.find('\n');
+            size_t length = (newline == std::string::npos) ? pending.size() : newline;
+            if(length > max_server_request) {
+                server_reply_error(*connection, "request longer than " + std::to_string(max_server_request) + " bytes");
+                shutdown(connection->fd, SHUT_RD);
+                connection->reading = false;
+                return;
+            }
+            if(newline == std::string::npos) {
+                break;
+            }
+            std::string line = pending.substr(0, newline);
+            pending.erase(0, newline + 1);
+            if(line.find_first_not_of(" \t\r") == std::string::npos) {
+                continue;
+            }
+            {
+                std::unique_lock<std::mutex> lock(server_mutex);
+                server_requests.push_back({connection, line});
+            }
+            server_request_available.notify_one();
+        }
+    }
+}
+
+void serve_request(const server_request& request)
+{
+    json_value root;
+    std::string error;
+    if(!parse_json(request.text, root, error)) {
+        server_reply_error(*request.connection, error);
+        return;
+    }
+    const json_value *command = root.find("command");
+    if(command && command->string == "shutdown") {
+        server_stopping = true;
+        request.connection->queue_reply("{\"status\": \"ok\"}\n");
+        return;
+    }
+
+    render_job job;
+    if(!parse_job(request.text, job, error)) {
+        server_reply_error(*request.connection, error);
+        return;
+    }
+    const json_value *reply_kind = root.find("reply");
+    bool reply_bytes = reply_kind && reply_kind->string == "bytes";
+
+    auto started = std::chrono::steady_clock::now();
+    if(!run_job(job)) {
+        server_reply_error(*request.connection, "couldn't render " + job.output);
+        return;
+    }
+    // The path (or bytes) are only useful once the file is complete
+    wait_for_readbacks();
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+
+    std::string contents;
+    if(reply_bytes) {
+        FILE *fp = fopen(job.output.c_str(), "rb");
+        if(!fp) {
+            server_reply_error(*request.connection, "couldn't read back " + job.output);
+            return;
+        }
+        fseek(fp, 0, SEEK_END);
+        contents.resize(ftell(fp));
+        fseek(fp, 0, SEEK_SET);
+        size_t got = fread(&contents[0], 1, contents.size(), fp);
+        contents.resize(got);
+        fclose(fp);
+    }
+
+    std::string reply = "{\"status\": \"ok\", \"output\": \"" + json_escape(job.output) + "\", \"milliseconds\": " + std::to_string(elapsed.count());
+    if(reply_bytes) {
+        reply += ", \"bytes\": " + std::to_string(contents.size());
+    }
+    reply += "}\n";
+    request.connection->queue_reply(reply + contents);
+}
+
+int run_server(const char *path)
+{
+    job_defaults = settings;
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listener < 0) {
+        perror("socket");
+        return EXIT_FAILURE;
+    }
+
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(address.sun_path)) {
+        std::cerr << "socket path " << path << " is too long\n";
+        return EXIT_FAILURE;
+    }
+    strcpy(address.sun_path, path);
+
+    // Only a stale socket (one nobody answers on) is removed; anything
+    // else at the path is left for bind to report
+    struct stat existing;
+    if(lstat(path, &existing) == 0 && S_ISSOCK(existing.st_mode)) {
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        bool live = probe >= 0 && connect(probe, (sockaddr*)&address, sizeof(address)) == 0;
+        if(probe >= 0) {
+            close(probe);
+        }
+        if(live) {
+            std::cerr << "a server is already listening on " << path << "\n";
+            close(listener);
+            return EXIT_FAILURE;
+        }
+        unlink(path);
+    }
+
+    if(bind(listener, (sockaddr*)&address, sizeof(address)) < 0 || listen(listener, 16) < 0) {
+        perror(path);
+        close(listener);
+        return EXIT_FAILURE;
+    }
+    std::cout << "serving on " << path << "\n";
+
+    // Connections are read on their own threads; rendering stays here.
+    // Readers of closed connections are joined as new ones arrive, once
+    // their replies have gone out.
+    std::vector<std::pair<std::thread, std::shared_ptr<server_connection>>> readers;
+    std::mutex readers_mutex;
+    std::thread acceptor([listener, &readers, &readers_mutex]() {
+        for(;;) {
+            int fd = accept(listener, nullptr, nullptr);
+            if(fd < 0) {
+                return;     // the listener was shut down
+            }
+            auto connection = std::make_shared<server_connection>(fd);
+            std::lock_guard<std::mutex> lock(readers_mutex);
+            for(auto reader = readers.begin(); reader != readers.end(); ) {
+                if(!reader->second->reading && reader->second->replies_sent()) {
+                    reader->first.join();
+                    reader = readers.erase(reader);
+                } else {
+                    ++reader;
+                }
+            }
+            readers.emplace_back(std::thread(server_read_requests, connection), connection);
+        }
+    });
+
+    while(!server_stopping) {
+        server_request request;
+        {
+            std::unique_lock<std::mutex> lock(server_mutex);
+            server_request_available.wait(lock, []{ return !server_requests.empty(); });
+            request = server_requests.front();
+            server_requests.pop_front();
+        }
+        serve_request(request);
+    }
+
+    shutdown(listener, SHUT_RDWR);
+    close(listener);
+    acceptor.join();
+
+    // Wake the readers out of recv, then answer whatever they had queued
+    for(auto& reader : readers) {
+        shutdown(reader.second->fd, SHUT_RD);
+        reader.first.join();
+    }
+    for(const auto& request : server_requests) {
+        server_reply_error(*request.connection, "the server is shutting down");
+    }
+    server_requests.clear();
+    readers.clear();    // sends anything still queued
+    unlink(path);
+    return EXIT_SUCCESS;
+}
+
+#endif // _WIN32
+
+// Numbers from the environment must parse completely and fall in range;
+// anything else stops the program rather than running with a zero
+uint64_t env_integer(const char *name, uint64_t min, uint64_t max)
+{
+    const char *text = getenv(name);
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if(!isdigit((unsigned char)text[0]) || *end != '\0' || errno == ERANGE || value < min || value > max) {
+        std::cerr << name << " must be a whole number from " << min << " to " << max << "\n";
+        exit(EXIT_FAILURE);
+    }
+    return value;
+}
+
+float env_float(const char *name, bool positive)
+{
+    const char *text = getenv(name);
+    char *end;
+    double value = strtod(text, &end);
+    if(end == text || *end != '\0' || !std::isfinite(value) || std::fabs(value) > FLT_MAX || (positive && !(value > 0.0))) {
+        std::cerr << name << " must be a " << (positive ? "positive" : "finite") << " number\n";
+        exit(EXIT_FAILURE);
+    }
+    return value;
+}
+
+int main(int argc, char **argv)
+{
+    be_noisy = (getenv("BE_NOISY") != NULL);
+    print_startup_timing = (getenv("STARTUP_TIMING") != NULL);
+    print_barrier_stats = (getenv("BARRIER_STATS") != NULL);
+    enable_validation = (getenv("VALIDATE") != NULL);
+    settings.exit_on_convergence = (getenv("EXIT_ON_CONVERGENCE") != NULL);
+    if(getenv("TARGET_ERROR") != NULL) {
+        settings.target_error = env_float("TARGET_ERROR", true);
+    }
+    if(getenv("MAX_FRAMES") != NULL) {
+        settings.max_frames = env_integer("MAX_FRAMES", 1, UINT32_MAX);
+    }
+    if(getenv("EXPOSURE") != NULL) {
+        settings.exposure = env_float("EXPOSURE", false);
+    }
+    if(getenv("OUTPUT_BITS") != NULL) {
+        settings.output_bits = env_integer("OUTPUT_BITS", 8, 10);
+        if(settings.output_bits != 8 && settings.output_bits != 10) {
+            std::cerr << "OUTPUT_BITS must be 8 or 10\n";
+            exit(EXIT_FAILURE);
+        }
+    }
+    if(getenv("TONEMAP") != NULL) {
+        for(uint32_t i = 0; i < TONEMAP_OPERATOR_COUNT; i++) {
+            if(strcmp(getenv("TONEMAP"), tone_operator_names[i]) == 0) {
+                settings.tone_operator = i;
+            }
+        }
+    }
+
+    // FRAME_SIZE=WxH renders a frame of any size through images of at
+    // most REGION_SIZE square, written to TILED_OUTPUT without a window
+    const char *tiled_output = getenv("TILED_OUTPUT");
+    if(getenv("FRAME_SIZE") != NULL) {
+        if(sscanf(getenv("FRAME_SIZE"), "%ux%u", &frame_width, &frame_height) != 2 || frame_width == 0 || frame_height == 0) {
+            std::cerr << "FRAME_SIZE must look like 16384x16384\n";
+            exit(EXIT_FAILURE);
+        }
+    }
+    if(getenv("REGION_SIZE") != NULL) {
+        max_region_size = env_integer("REGION_SIZE", 1, 65536);
+    }
+
+    // Cap on device memory held by meshes and BLASes across scenes
+    if(getenv("GEOMETRY_BUDGET_MB") != NULL) {
+        geometry_budget = env_integer("GEOMETRY_BUDGET_MB", 0, 1ull << 40) * 1024 * 1024;
+    }
+    // Cap on host memory held by serialized BLASes of evicted meshes
+    if(getenv("SERIALIZED_BLAS_MB") != NULL) {
+        serialized_blas_budget = env_integer("SERIALIZED_BLAS_MB", 0, 1ull << 40) * 1024 * 1024;
+    }
+    if(getenv("STREAM_RADIUS") != NULL) {
+        stream_radius = env_float("STREAM_RADIUS", true);
+    }
+    if(getenv("LOD_PIXELS") != NULL) {
+        lod_pixels = env_float("LOD_PIXELS", true);
+    }
+    if(getenv("LOD_LEVELS") != NULL) {
+        max_lod_levels = env_integer("LOD_LEVELS", 0, 16);
+    }
+    if(getenv("HOST_BUILDS") != NULL) {
+        if(strcmp(getenv("HOST_BUILDS"), "auto") == 0) {
+            host_builds = HOST_BUILDS_AUTO;
+        } else if(strcmp(getenv("HOST_BUILDS"), "all") == 0) {
+            host_builds = HOST_BUILDS_ALL;
+        } else if(strcmp(getenv("HOST_BUILDS"), "off") != 0) {
+            std::cerr << "HOST_BUILDS must be off, auto or all\n";
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // vkrt --batch jobs.jsonl renders every job in the file on one device;
+    // vkrt --serve socket takes jobs over a Unix domain socket until shut down
+    const char *batch_file = (argc == 3 && strcmp(argv[1], "--batch") == 0) ? argv[2] : nullptr;
+    const char *server_socket = (argc == 3 && strcmp(argv[1], "--serve") == 0) ? argv[2] : nullptr;
+
+    if(tiled_output || batch_file || server_socket) {
+        image_width = std::min(frame_width, max_region_size);
+        image_height = std::min(frame_height, max_region_size);
+    } else {
+        image_width = frame_width;
+        image_height = frame_height;
+    }
+    region = {0, 0, image_width, image_height};
+    headless = tiled_output || batch_file || server_socket;
+
+    glfwSetErrorCallback(error_callback);
+
+    if(tiled_output && getenv("DEVICES") != NULL) {
+#ifndef _WIN32
+        std::vector<std::string> selectors;
+        std::string list = getenv("DEVICES");
+        size_t start = 0;
+        while(start <= list.size()) {
+            size_t comma = list.find(',', start);
+            if(comma == std::string::npos) {
+                comma = list.size();
+            }
+            if(comma > start) {
+                selectors.push_back(list.substr(start, comma - start));
+            }
+            start = comma + 1;
+        }
+        exit(render_tiled_multi_device(tiled_output, selectors));
+#else
+        std::cerr << "DEVICES needs fork()\n";
+        exit(EXIT_FAILURE);
+#endif
+    }
+
+    if(!headless) {
+        if(!glfwInit()) {
+            std::cerr << "GLFW initialization failed.\n";
+            exit(EXIT_FAILURE);
+        }
+
+        if (!glfwVulkanSupported()) {
+            std::cerr << "GLFW reports Vulkan is not supported\n";
+            exit(EXIT_FAILURE);
+        }
+        end_startup_phase("glfw");
+    }
+
+    init_vulkan();
+
+    if(server_socket) {
+#ifndef _WIN32
+        prepare_vulkan();
+        int status = run_server(server_socket);
+        cleanup_vulkan();
+        exit(status);
+#else
+        std::cerr << "--serve needs Unix domain sockets\n";
+        exit(EXIT_FAILURE);
+#endif
+    }
+
+    if(batch_file) {
+        prepare_vulkan();
+        int status = run_batch(batch_file);
+        cleanup_vulkan();
+        exit(status);
+    }
+
+    if(tiled_output) {
+        prepare_vulkan();
+        render_tiled(tiled_output);
+        cleanup_vulkan();
+        exit(EXIT_SUCCESS);
+    }
+
+    glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
+    GLFWwindow* window = glfwCreateWindow(image_width, image_height, "vulkan test", NULL, NULL);
+
+    glfwSetKeyCallback(window, key_callback);
+
+    VkResult err = glfwCreateWindowSurface(instance, window, NULL, &surface);
+    if (err) {
+        std::cerr << "GLFW window creation failed " << err << "\n";
+        exit(EXIT_FAILURE);
+    }
+
+
+    prepare_vulkan();
+
+    // CAPTURE=frame%04d.ppm saves every traced frame
+    const char *capture = getenv("CAPTURE");
+    uint32_t captured = 0;
+
+    while (!glfwWindowShouldClose(window)) {
+
+        update_streaming();
+        update_lods();
+        if(draw_frame() && capture) {
+            char filename[512];
+            snprintf(filename, sizeof(filename), capture, captured++);
+            screenshot(filename);
+        }
+
+        if(accumulation.converged) {
+            if(settings.exit_on_convergence) {
+                break;
+            }
+            // Idle until a key changes the settings or a variant finishes compiling
+            glfwWaitEventsTimeout(0.1);
+        } else {
+            glfwPollEvents();
+        }
+    }
+
+    cleanup_vulkan();
+}
+
@@ -0,0 +1,33 @@
+// Progressive accumulation state shared by raygen and worklist.comp; must match main.cpp
+
+// rgb sums samples, alpha sums their squared luminance
+layout(binding = 3, set = 0, rgba32f) uniform image2D accumulation_image;
+layout(binding = 6, set = 0, r32ui) uniform uimage2D sample_count_image;
+
+// Mirrors struct work_list_header followed by (pixel index, sample count) entries
+layout(binding = 5, set = 0) buffer work_list_buffer
+{
+    uint width;     // entry count, read as the trace-rays indirect command
+    uint height;
+    uint depth;
+    uint padding;
+    uvec2 entries[];
+} work_list;
+
+float luminance(vec3 color)
+{
+    return dot(color, vec3(0.2126, 0.7152, 0.0722));
+}
+
+// Relative standard error of a pixel's mean luminance; unknown until it
+// has two samples
+float relative_error(vec4 sum, uint n)
+{
+    if(n < 2)
+        return 1.0e30;
+
+    float count = float(n);
+    float mean = luminance(sum.rgb) / count;
+    float variance = max(0.0, (sum.a / count - mean * mean) * count / (count - 1.0));
+    return sqrt(variance / count) / (mean + 0.01);
+}
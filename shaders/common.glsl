@@ -0,0 +1,61 @@
+// Declarations shared by the ray tracing stages; must match main.cpp
+
+// Mirror struct specialization_constants; every pipeline variant sets
+// these, so branches on them are folded away when the pipeline compiles
+layout(constant_id = 0) const uint max_bounces = 1;
+layout(constant_id = 1) const uint samples_per_pixel = 1;
+layout(constant_id = 2) const bool any_hit_enabled = false;
+layout(constant_id = 3) const uint material_features = 0;
+
+// Mirror MATERIAL_* in main.cpp
+const uint MATERIAL_VERTEX_COLOR = 0x1;
+const uint MATERIAL_CHECKER = 0x2;
+const uint MATERIAL_CUTOUT = 0x4;
+
+// Must fit in max_ray_payload_size
+struct hit_payload
+{
+    vec3 color;         // light leaving the hit toward the ray origin, or the sky
+    vec3 attenuation;   // reflectance applied to the next bounce
+    vec3 position;
+    vec3 normal;
+    float distance;     // negative on a miss
+    uint seed;
+};
+
+// Mirrors struct camera_constants
+struct camera_constants
+{
+    vec4 position;
+    vec4 right;
+    vec4 up;
+    vec4 forward;
+};
+
+// Mirrors struct frame_constants
+layout(push_constant) uniform frame_constants
+{
+    camera_constants camera;
+    uint frame_index;
+    uint adaptive;
+    uvec2 region_offset;    // where the GPU images sit within the frame
+    uvec2 region_extent;
+    uvec2 frame_size;
+} frame;
+
+// Mirrors tile_size; convergence is tracked per tile
+const uint TILE_SIZE = 16;
+
+uint pcg_hash(uint v)
+{
+    uint state = v * 747796405u + 2891336453u;
+    uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+// Uniform in [0, 1)
+float random(inout uint seed)
+{
+    seed = pcg_hash(seed);
+    return float(seed) * (1.0 / 4294967296.0);
+}
@@ -0,0 +1,47 @@
+// Access to mesh geometry from hit shaders; must match main.cpp
+
+// Mirrors struct Vertex
+struct vertex
+{
+    vec3 v;
+    vec3 c;
+};
+
+layout(buffer_reference, scalar) readonly buffer vertex_array { vertex vertices[]; };
+layout(buffer_reference, scalar) readonly buffer index_array { uint indices[]; };
+
+// Mirrors struct mesh_info; indexed by the instance custom index
+struct mesh_info
+{
+    vertex_array vertices;
+    index_array indices;
+};
+
+layout(binding = 2, set = 0, scalar) readonly buffer mesh_table { mesh_info meshes[]; };
+
+struct surface
+{
+    vec3 position;
+    vec3 normal;        // world space, facing the incoming ray
+    vec3 color;         // interpolated vertex color
+};
+
+surface get_hit_surface(vec2 attribs)
+{
+    mesh_info m = meshes[gl_InstanceCustomIndexEXT];
+    vertex v0 = m.vertices.vertices[m.indices.indices[3 * gl_PrimitiveID + 0]];
+    vertex v1 = m.vertices.vertices[m.indices.indices[3 * gl_PrimitiveID + 1]];
+    vertex v2 = m.vertices.vertices[m.indices.indices[3 * gl_PrimitiveID + 2]];
+
+    vec3 barycentrics = vec3(1.0 - attribs.x - attribs.y, attribs.x, attribs.y);
+
+    surface s;
+    s.position = gl_WorldRayOriginEXT + gl_WorldRayDirectionEXT * gl_HitTEXT;
+    s.color = v0.c * barycentrics.x + v1.c * barycentrics.y + v2.c * barycentrics.z;
+    s.normal = normalize(mat3(gl_ObjectToWorldEXT) * cross(v1.v - v0.v, v2.v - v0.v));
+    if(dot(s.normal, gl_WorldRayDirectionEXT) > 0.0)
+        s.normal = -s.normal;
+    return s;
+}
+
+const vec3 light_direction = normalize(vec3(0.5, 1.0, -0.3));
@@ -0,0 +1,155 @@
+// Sends render jobs to "vkrt --serve" and prints the replies.
+//
+//   vkrt_client SOCKET [--save FILE] [JOB ...]
+//
+// Each JOB is one JSON object as accepted by vkrt --batch; with no JOB
+// arguments, jobs are read one per line from stdin.  Replies that carry
+// image bytes are written to FILE (or the job's output name).
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+bool send_all(int fd, const std::string& data)
+{
+    const char *p = data.data();
+    size_t size = data.size();
+    while(size > 0) {
+        ssize_t sent = send(fd, p, size, MSG_NOSIGNAL);
+        if(sent <= 0) {
+            return false;
+        }
+        p += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+// Reads up to and including a newline; leftover bytes stay in pending
+bool receive_line(int fd, std::string& pending, std::string& line)
+{
+    size_t newline;
+    while((newline = pending.find('\n')) == std::string::npos) {
+        char buffer[4096];
+        ssize_t received = recv(fd, buffer, sizeof(buffer), 0);
+        if(received <= 0) {
+            return false;
+        }
+        pending.append(buffer, received);
+    }
+    line = pending.substr(0, newline);
+    pending.erase(0, newline + 1);
+    return true;
+}
+
+bool receive_bytes(int fd, std::string& pending, size_t count, std::vector<char>& out)
+{
+    out.assign(pending.begin(), pending.begin() + std::min(count, pending.size()));
+    pending.erase(0, out.size());
+    while(out.size() < count) {
+        char buffer[65536];
+        ssize_t received = recv(fd, buffer, std::min(sizeof(buffer), count - out.size()), 0);
+        if(received <= 0) {
+            return false;
+        }
+        out.insert(out.end(), buffer, buffer + received);
+    }
+    return true;
+}
+
+// Replies are produced by vkrt itself, so a plain search is enough
+std::string reply_field(const std::string& reply, const char *name)
+{
+    std::string key = std::string("\"") + name + "\": ";
+    size_t at = reply.find(key);
+    if(at == std::string::npos) {
+        return "";
+    }
+    at += key.size();
+    if(reply[at] == '"') {
+        size_t end = reply.find('"', at + 1);
+        return reply.substr(at + 1, end - at - 1);
+    }
+    size_t end = reply.find_first_of(",}", at);
+    return reply.substr(at, end - at);
+}
+
+int main(int argc, char **argv)
+{
+    if(argc < 2) {
+        std::cerr << "usage: " << argv[0] << " SOCKET [--save FILE] [JOB ...]\n";
+        exit(EXIT_FAILURE);
+    }
+
+    std::string save_as;
+    std::vector<std::string> jobs;
+    for(int i = 2; i < argc; i++) {
+        if(strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+            save_as = argv[++i];
+        } else {
+            jobs.push_back(argv[i]);
+        }
+    }
+    if(jobs.empty()) {
+        std::string line;
+        while(std::getline(std::cin, line)) {
+            if(!line.empty()) {
+                jobs.push_back(line);
+            }
+        }
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, argv[1], sizeof(address.sun_path) - 1);
+    if(fd < 0 || connect(fd, (sockaddr*)&address, sizeof(address)) < 0) {
+        perror(argv[1]);
+        exit(EXIT_FAILURE);
+    }
+
+    int failures = 0;
+    std::string pending;
+    for(auto& job : jobs) {
+        std::string reply;
+        if(!send_all(fd, job + "\n") || !receive_line(fd, pending, reply)) {
+            std::cerr << "lost connection to server\n";
+            exit(EXIT_FAILURE);
+        }
+        std::cout << reply << "\n";
+        if(reply_field(reply, "status") != "ok") {
+            failures++;
+            continue;
+        }
+
+        std::string byte_count = reply_field(reply, "bytes");
+        if(!byte_count.empty()) {
+            std::vector<char> contents;
+            if(!receive_bytes(fd, pending, strtoull(byte_count.c_str(), nullptr, 10), contents)) {
+                std::cerr << "lost connection to server\n";
+                exit(EXIT_FAILURE);
+            }
+            std::string filename = save_as.empty() ? reply_field(reply, "output") : save_as;
+            FILE *fp = fopen(filename.c_str(), "wb");
+            if(!fp) {
+                perror(filename.c_str());
+                failures++;
+                continue;
+            }
+            fwrite(contents.data(), 1, contents.size(), fp);
+            fclose(fp);
+        }
+    }
+
+    close(fd);
+    exit(failures ? EXIT_FAILURE : EXIT_SUCCESS);
+}